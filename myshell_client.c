@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "myshell_daemon.h"
+
+// Tiny client for "myshellv5 --daemon": runs one command line through the
+// daemon with this process's working directory, environment and standard
+// descriptors, and exits with the command's status.
+//
+//     myshell_client [-s socket] command [args...]
+
+extern char** environ;
+
+// Write all of buf, retrying short writes
+static int write_full(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    char default_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    const char* path = NULL;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+        path = argv[2];
+        first = 3;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "usage: %s [-s socket] command [args...]\n", argv[0]);
+        return 2;
+    }
+    if (path == NULL) {
+        path = daemon_socket_path(default_path, sizeof(default_path));
+    }
+
+    // The command line is the remaining arguments joined by spaces
+    size_t cmd_len = 0;
+    for (int i = first; i < argc; i++) {
+        cmd_len += strlen(argv[i]) + 1;
+    }
+    char* cmdline = calloc(cmd_len + 1, 1);
+    for (int i = first; i < argc; i++) {
+        strcat(cmdline, argv[i]);
+        if (i < argc - 1) {
+            strcat(cmdline, " ");
+        }
+    }
+    cmd_len = strlen(cmdline);
+
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("getcwd failed");
+        return 1;
+    }
+    size_t env_len = 0;
+    for (char** e = environ; *e != NULL; e++) {
+        env_len += strlen(*e) + 1;
+    }
+    char* env = malloc(env_len + 1);
+    char* p = env;
+    for (char** e = environ; *e != NULL; e++) {
+        size_t n = strlen(*e) + 1;
+        memcpy(p, *e, n);
+        p += n;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Cannot connect to daemon");
+        return 1;
+    }
+
+    // Header plus our stdin, stdout and stderr as SCM_RIGHTS
+    struct daemon_request req = {DAEMON_MAGIC, cmd_len, strlen(cwd), env_len};
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, 0) != sizeof(req) ||
+        write_full(sock, cmdline, cmd_len) < 0 ||
+        write_full(sock, cwd, req.cwd_len) < 0 ||
+        write_full(sock, env, env_len) < 0) {
+        perror("Failed to send request");
+        return 1;
+    }
+
+    struct daemon_reply reply;
+    size_t got = 0;
+    while (got < sizeof(reply)) {
+        ssize_t n = read(sock, (char*)&reply + got, sizeof(reply) - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Daemon closed the connection\n");
+            return 1;
+        }
+        got += n;
+    }
+    if (reply.magic != DAEMON_MAGIC) {
+        fprintf(stderr, "Bad reply from daemon\n");
+        return 1;
+    }
+    return reply.status;
+}
@@ -0,0 +1,44 @@
+// Protocol between "myshellv5 --daemon" and myshell_client.
+//
+// The client connects to the daemon's UNIX-domain socket and sends one
+// struct daemon_request together with its stdin, stdout and stderr as
+// SCM_RIGHTS ancillary data. The command line, working directory and
+// environment (NUL-separated NAME=value strings) follow as plain bytes.
+// The daemon runs the command with those descriptors and answers with one
+// struct daemon_reply once it has finished.
+
+#ifndef MYSHELL_DAEMON_H
+#define MYSHELL_DAEMON_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define DAEMON_MAGIC 0x50534844  // "PSHD"
+#define DAEMON_SOCKET_ENV "PUCITSH_SOCKET"
+#define DAEMON_MAX_PAYLOAD (16 * 1024 * 1024)
+
+struct daemon_request {
+    uint32_t magic;
+    uint32_t cmd_len;  // Bytes of the command line, without a terminator
+    uint32_t cwd_len;  // Bytes of the working directory
+    uint32_t env_len;  // Bytes of the environment block
+};
+
+struct daemon_reply {
+    uint32_t magic;
+    int32_t status;    // Exit status of the command line
+};
+
+// Socket path: $PUCITSH_SOCKET, or a per-user path in /tmp
+static inline const char* daemon_socket_path(char* buf, size_t len) {
+    const char* env = getenv(DAEMON_SOCKET_ENV);
+    if (env != NULL && *env) {
+        return env;
+    }
+    snprintf(buf, len, "/tmp/pucitsh-%d.sock", (int)getuid());
+    return buf;
+}
+
+#endif
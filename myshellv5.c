@@ -1,271 +1,7423 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <signal.h>
-#include <readline/readline.h>
-#include <readline/history.h>
-
-#define MAX_LEN 512
-#define MAXARGS 10
-#define ARGLEN 30
-#define PROMPT "PUCITshell:- "
-#define HISTORY_SIZE 100
-
-// Function prototypes
-int execute_pipeline(char** cmds[], int cmd_count, int background);
-char** tokenize(char* cmdline);
-char* read_cmd(char* prompt);
-void free_tokens(char** tokens);
-void add_to_history(const char* cmd);
-void execute_history_command(int index);
-
-pid_t background_processes[MAX_LEN];
-int bg_process_count = 0;
-
-// Signal handler for SIGCHLD to clean up terminated background processes
-void handle_sigchld(int sig) {
-    int saved_errno = errno;
-    while (waitpid(-1, NULL, WNOHANG) > 0);
-    errno = saved_errno;
-}
-
-int main() {
-    // Set up the signal handler to avoid zombie processes
-    struct sigaction sa;
-    sa.sa_handler = &handle_sigchld;
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGCHLD, &sa, NULL);
-
-    using_history();  // Initialize history handling
-    char* cmdline;
-
-    while ((cmdline = read_cmd(PROMPT)) != NULL) {
-        // Check for history command
-        if (cmdline[0] == '!') {
-            int index = atoi(&cmdline[1]);
-            if (index > 0 && index <= history_length) {
-                execute_history_command(index);
-                free(cmdline);
-                continue;
-            } else {
-                fprintf(stderr, "No such command in history: %d\n", index);
-                free(cmdline);
-                continue;
-            }
-        }
-
-        // Add command to history
-        if (strlen(cmdline) > 0) {
-            add_history(cmdline);  // Add the command to history for arrow key navigation
-        }
-
-        // Check if the command should be run in the background
-        int background = 0;
-        if (cmdline[strlen(cmdline) - 1] == '&') {
-            background = 1;
-            cmdline[strlen(cmdline) - 1] = '\0'; // Remove '&' from the end
-        }
-
-        int cmd_count = 0;
-        char* cmds[MAXARGS];
-
-        // Split input by pipes
-        char* token = strtok(cmdline, "|");
-        while (token != NULL && cmd_count < MAXARGS) {
-            cmds[cmd_count++] = strdup(token);
-            token = strtok(NULL, "|");
-        }
-
-        // Parse each command in the pipeline and execute
-        char** parsed_cmds[MAXARGS] = {NULL};
-        for (int i = 0; i < cmd_count; i++) {
-            parsed_cmds[i] = tokenize(cmds[i]);
-        }
-
-        // Execute built-in commands or pipeline
-        if (strcmp(parsed_cmds[0][0], "exit") == 0) {
-            exit(0);
-        } else if (strcmp(parsed_cmds[0][0], "help") == 0) {
-            printf("Available commands:\n");
-            printf("cd <dir>   - Change the working directory to <dir>\n");
-            printf("exit       - Exit the shell\n");
-            printf("jobs       - List background jobs\n");
-            printf("kill <pid> - Terminate the process with the specified <pid>\n");
-            printf("help       - Display this help message\n");
-        } else if (strcmp(parsed_cmds[0][0], "jobs") == 0) {
-            printf("Background jobs:\n");
-            for (int i = 0; i < bg_process_count; i++) {
-                printf("[%d] %d\n", i + 1, background_processes[i]);
-            }
-        } else if (strcmp(parsed_cmds[0][0], "cd") == 0) {
-            if (parsed_cmds[0][1] != NULL) {
-                if (chdir(parsed_cmds[0][1]) != 0) {
-                    perror("cd failed");
-                }
-            } else {
-                fprintf(stderr, "cd: missing argument\n");
-            }
-        } else if (strcmp(parsed_cmds[0][0], "kill") == 0) {
-            if (parsed_cmds[0][1] != NULL) {
-                pid_t pid = atoi(parsed_cmds[0][1]);
-                if (kill(pid, SIGKILL) == -1) {
-                    perror("kill failed");
-                }
-            } else {
-                fprintf(stderr, "kill: missing argument\n");
-            }
-        } else {
-            execute_pipeline(parsed_cmds, cmd_count, background);
-        }
-
-        // Free dynamically allocated memory
-        for (int i = 0; i < cmd_count; i++) {
-            free_tokens(parsed_cmds[i]);
-            free(cmds[i]);
-        }
-        free(cmdline);
-    }
-    printf("\n");
-    return 0;
-}
-
-// Function to execute a pipeline of commands
-int execute_pipeline(char** cmds[], int cmd_count, int background) {
-    int fd[2], in_fd = 0;
-    int status;
-
-    for (int i = 0; i < cmd_count; i++) {
-        // Create pipe for the current command
-        if (i < cmd_count - 1) {
-            pipe(fd);
-        }
-
-        char** arglist = cmds[i];
-
-        // Handle output redirection
-        int out_fd = STDOUT_FILENO;
-        for (int j = 0; arglist[j] != NULL; j++) {
-            if (strcmp(arglist[j], ">") == 0) {
-                if (arglist[j + 1] != NULL) {
-                    out_fd = open(arglist[j + 1], O_CREAT | O_WRONLY | O_TRUNC, 0644);
-                    if (out_fd < 0) {
-                        perror("Failed to open output file");
-                        return -1;
-                    }
-                    arglist[j] = NULL;
-                }
-            } else if (strcmp(arglist[j], "<") == 0) {
-                if (arglist[j + 1] != NULL) {
-                    in_fd = open(arglist[j + 1], O_RDONLY);
-                    if (in_fd < 0) {
-                        perror("Failed to open input file");
-                        return -1;
-                    }
-                    arglist[j] = NULL;
-                }
-            }
-        }
-
-        int pid = fork();
-        if (pid == 0) {
-            // Child process
-            if (in_fd != STDIN_FILENO) {
-                dup2(in_fd, STDIN_FILENO);
-                close(in_fd);
-            }
-            if (i < cmd_count - 1) {
-                dup2(fd[1], STDOUT_FILENO);
-                close(fd[0]);
-            } else if (out_fd != STDOUT_FILENO) {
-                dup2(out_fd, STDOUT_FILENO);
-                close(out_fd);
-            }
-            execvp(arglist[0], arglist);
-            perror("Command execution failed");
-            exit(1);
-        } else if (pid < 0) {
-            perror("Fork failed");
-            return -1;
-        }
-        
-        if (in_fd != STDIN_FILENO) {
-            close(in_fd);
-        }
-        if (i < cmd_count - 1) {
-            close(fd[1]);
-        }
-        in_fd = fd[0];
-
-        if (!background) {
-            waitpid(pid, &status, 0);
-        } else {
-            background_processes[bg_process_count++] = pid;
-            printf("[%d] %d\n", bg_process_count, pid);  // Print background job id
-        }
-    }
-
-    if (!background && cmd_count > 0) {
-        waitpid(-1, &status, 0);
-    }
-
-    return 0;
-}
-
-// Tokenize the command line into arguments
-char** tokenize(char* cmdline) {
-    char** tokens = malloc(MAXARGS * sizeof(char*));
-    if (!tokens) {
-        perror("Failed to allocate memory for tokens");
-        exit(1);
-    }
-    char* token = strtok(cmdline, " \n");
-    int i = 0;
-
-    while (token != NULL && i < MAXARGS - 1) {
-        tokens[i++] = strdup(token);
-        token = strtok(NULL, " \n");
-    }
-    tokens[i] = NULL;
-    return tokens;
-}
-
-// Read a command line with a prompt
-char* read_cmd(char* prompt) {
-    char* input = readline(prompt);
-    return input;
-}
-
-// Free allocated tokens
-void free_tokens(char** tokens) {
-    for (int i = 0; tokens[i] != NULL; i++) {
-        free(tokens[i]);
-    }
-    free(tokens);
-}
-
-// Add command to history
-void add_to_history(const char* cmd) {
-    if (strlen(cmd) > 0) {
-        add_history(cmd);
-    }
-}
-
-// Execute command from history
-void execute_history_command(int index) {
-    HIST_ENTRY *entry = history_get(index);
-    if (entry) {
-        char *cmdline = strdup(entry->line);
-        printf("Executing: %s\n", cmdline);
-
-        // Call the main command execution logic with the retrieved command line
-        // Instead of main_loop, you can directly invoke the execution logic here.
-        // Implement the logic similar to the one in main() for processing the command.
-        // For simplicity, we're just printing the command here.
-        free(cmdline);
-    }
-}
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <termios.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <math.h>
+#include "myshell_daemon.h"
+#include "pucitsh.h"
+#ifndef BUILTIN_EDITOR
+#include <readline/readline.h>
+#include <readline/history.h>
+#endif
+
+#define MAX_LEN 512
+#define MAXARGS 10
+#define ARGLEN 30
+#define PROMPT "PUCITshell:- "
+#define HISTORY_SIZE 100
+#define CONTINUE_PROMPT "> "                  // Prompt for lines that continue a command
+#define REDIRECT_FD_MIN 10                    // Shell-owned descriptors live at or above this
+#define CAPTURE_INITIAL (64 * 1024)           // First buffer size for $(...) output
+#define CAPTURE_SPLICE_MIN (64 * 1024 * 1024) // Beyond this, splice the rest into a memfd
+#define VAR_BUCKETS 256                       // Hash buckets of the shell variable table
+#define INPUT_BUFFER 8192                     // Read-ahead for script files
+#define LIMIT_GRACE 5                         // Default seconds from SIGTERM to SIGKILL for limit --wall
+#define MAX_JOBS 1024                         // Size of the job table
+#define ALIAS_DEPTH 16                        // Aliases expanding inside each other at most
+#define PATH_DIRS_MAX 64                      // PATH directories indexed for command completion
+#define DIR_CACHE_SIZE 8                      // Directory listings kept for file name completion
+#define SPOOL_SIZE (256 * 1024)               // Output kept per spooled background job
+#define PPROF_SAMPLE_MS 1                     // How often a pprof relay waiting for input checks its output pipe
+#define AUDIT_RING 256                        // Audit records queued for the writer thread at most
+#define AUDIT_TEXT 256                        // Bytes of the directory and of the command in a record
+#define AUDIT_SYNC_MS 1000                    // Longest time audit records sit unsynced in the page cache
+#define SUGGEST_GROWTH 1.0027                 // Weight of a new use of a line over one a command earlier:
+                                              // a use counts half as much after about 256 commands
+
+// Function prototypes
+struct node;
+struct capture;
+struct input;
+int execute_cmdline(const char* cmdline);
+int run_input(struct input* in);
+int run_node(struct node* n);
+int execute_pipeline(struct node** stages, int cmd_count, int background);
+pid_t spawn_subshell(const char* cmdline, int in_fd, int out_fd);
+char** expand_words(char** tokens, struct capture** captures);
+char* expand_assignment(char* word, struct capture** captures);
+void free_captures(struct capture* captures);
+const char* get_var(const char* name);
+void set_var(const char* name, const char* value);
+int run_daemon(const char* path);
+char* read_cmd(char* prompt);
+void add_to_history(const char* cmd);
+const char* get_history_command(int index);
+int heredoc_fd(const char* body, size_t len);
+static int parse_redirect(const char* word, int* fd, const char** op);
+struct atomic_output;
+static int move_fd_high(int fd);
+static int is_ifs(char c);
+static void update_jobs(int report);
+static int audit_run(struct node* n);
+static int audit_wanted(void);
+static int write_all(int fd, const char* buf, size_t len);
+static void attach_spool(int id);
+static void finish_atomic_output(struct atomic_output* o, int status);
+#if !defined(BUILTIN_EDITOR) && !defined(PUCITSH_LIB)
+static void init_readline(void);
+#endif
+#ifndef PUCITSH_LIB
+static void init_job_control(void);
+static void run_rc_file(void);
+#endif
+
+// Allocation statistics for memstat, by what the memory is for. Build with
+// -DNO_MEMSTAT to compile the tracking out: mem_* are then plain libc calls.
+enum mem_category { MEM_PARSE, MEM_EXPAND, MEM_ENV, MEM_JOBS, MEM_HISTORY, MEM_OTHER, MEM_CATEGORIES };
+#ifdef NO_MEMSTAT
+#define mem_malloc(cat, n) malloc(n)
+#define mem_calloc(cat, count, n) calloc(count, n)
+#define mem_realloc(cat, p, n) realloc(p, n)
+#define mem_strdup(cat, s) strdup(s)
+#define mem_strndup(cat, s, n) strndup(s, n)
+#define mem_free(cat, p) free(p)
+#else
+void* mem_malloc(int cat, size_t n);
+void* mem_calloc(int cat, size_t count, size_t n);
+void* mem_realloc(int cat, void* p, size_t n);
+char* mem_strdup(int cat, const char* s);
+char* mem_strndup(int cat, const char* s, size_t n);
+void mem_free(int cat, void* p);
+#endif
+
+// Memory behind words produced by expand_words(): $(...) output buffers
+// (heap or mapped memfd) and words built from several pieces
+struct capture {
+    char* data;
+    size_t map_len;  // Length of the mapping for memfd captures, 0 for heap memory
+    struct capture* next;
+};
+
+// One redirection of a pipeline stage, applied in the child in order
+struct redirect {
+    int fd;      // Descriptor being redirected
+    int source;  // Descriptor copied onto fd, or -1 to close fd
+    int owned;   // source was opened by the shell and is closed after the fork
+};
+
+// Output of a >! redirection: an unnamed O_TMPFILE in the target's
+// directory that takes the target's name only if the command succeeds
+struct atomic_output {
+    int fd;
+    int dir;       // The target's directory, opened when the redirection was
+    char* name;    // Last component of the target
+    struct atomic_output* next;
+};
+
+// Kinds of node in a parsed command
+enum node_type {
+    NODE_COMMAND,   // Simple command: words
+    NODE_PIPELINE,  // kids are the stages
+    NODE_AND,       // kids[0] && kids[1]
+    NODE_OR,        // kids[0] || kids[1]
+    NODE_LIST,      // kids run one after another
+    NODE_IF,        // if kids[0] then kids[1] [else kids[2]]
+    NODE_WHILE,     // while kids[0] do kids[1]
+    NODE_UNTIL,     // until kids[0] do kids[1]
+    NODE_FOR,       // for name in words do kids[0]
+    NODE_GROUP,     // { kids[0] }
+    NODE_SUBSHELL,  // ( kids[0] )
+    NODE_FUNCTION,  // name() kids[0]
+};
+
+#define NODE_BACKGROUND 1  // List item followed by &
+#define NODE_NEGATE 2      // Pipeline preceded by !
+#define NODE_ALL_ARGS 4    // for loop without "in" walks the positional parameters
+
+// A parsed command. Input is parsed once into this tree and the interpreter
+// walks it, so loop and function bodies are never lexed again.
+struct node {
+    enum node_type type;
+    int flags;
+    char* name;           // Variable of a for loop, name of a function
+    char** words;         // Words of a simple command or for loop, NULL-terminated
+    int word_count;
+    char** redirs;        // Redirections after a compound command, NULL-terminated
+    int redir_count;
+    struct node** kids;
+    int kid_count;
+};
+
+// Where the lexer gets its lines from
+struct input {
+    int interactive;   // Read with read_cmd() and prompts, keep history
+    int audited;       // The shell's own commands, logged to $PUCITSH_AUDIT
+    int sourced;       // A file run by source: return leaves it
+    int exec_last;     // The last command replaces the shell instead of being waited for
+    int fd;            // Script file or standard input that is not a terminal, or -1
+    int unbuffered;    // Read fd a byte at a time so commands get the rest of it
+    char* buf;         // Read-ahead of fd; not a FILE, whose exit() in a forked
+    size_t len;        // child would seek the shared offset back
+    size_t pos;
+    const char* text;  // Rest of a -c string or subshell command line
+};
+
+enum token_type {
+    TOK_WORD, TOK_NEWLINE, TOK_SEMI, TOK_AMP, TOK_PIPE,
+    TOK_AND_IF, TOK_OR_IF, TOK_LPAREN, TOK_RPAREN, TOK_EOF
+};
+
+struct token {
+    enum token_type type;
+    char* word;  // Text of a TOK_WORD, owned by whoever takes the token
+};
+
+// Alias, a slot of an open-addressing table with linear probing
+struct alias {
+    char* name;     // NULL for a free slot, alias_removed after unalias
+    char* value;
+    int expanding;  // Its text is being scanned, so it does not expand again
+};
+
+// Where the lexer goes back to when it reaches the end of an alias's text
+struct alias_frame {
+    char* line;
+    char* pos;
+    struct alias* alias;
+};
+
+struct lexer {
+    struct input* in;
+    char* line;          // Line being scanned
+    char* pos;           // Next character, NULL when a new line is needed
+    int continued;       // Lines after the first of a command get CONTINUE_PROMPT
+    int eof;
+    int error;           // A syntax error was reported for this command
+    struct token peeked;
+    int has_peeked;
+    char*** heredoc_words[MAXARGS];  // Word arrays holding "<<DELIM" words
+    int heredoc_index[MAXARGS];      // whose bodies follow this line
+    int heredoc_count;
+    int aliases;         // Expand aliases: interactive input and the startup file
+    int alias_next;      // An alias ended in a blank, so the next word is one too
+    struct alias_frame alias_stack[ALIAS_DEPTH];
+    int alias_depth;
+};
+
+// Shell variable. Variables that came from the environment or were
+// exported are mirrored into it so commands see them.
+struct var {
+    char* name;
+    char* value;
+    int exported;
+    struct var* next;
+};
+
+struct function {
+    char* name;
+    struct node* body;
+    struct function* next;
+};
+
+// Descriptors a builtin reads and writes: 0, 1 and 2 when it runs in the
+// shell or a forked stage, its pipe ends when it runs on a pipeline thread
+struct builtin_io {
+    int in;
+    int out;
+    int err;
+};
+
+// Built-in commands run inside the shell process
+struct builtin {
+    const char* name;
+    int (*fn)(char** argv, struct builtin_io* io);
+    int threadable;  // Touches nothing but its descriptors, so it may run on a thread
+    const char* help;
+};
+
+// Resource limits of one command started with the limit builtin
+struct limits {
+    int active;
+    double cpu;            // CPU seconds (RLIMIT_CPU)
+    double wall;           // Wall-clock seconds, enforced by a watchdog thread
+    double grace;          // Seconds between SIGTERM and SIGKILL
+    rlim_t mem;            // Address space in bytes (RLIMIT_AS)
+    rlim_t nofile;         // Open descriptors (RLIMIT_NOFILE)
+    char command[ARGLEN];  // Name for the exit record
+};
+
+// Performance counters pstat reads for a command
+enum {
+    EV_TASK_CLOCK,
+    EV_CYCLES,
+    EV_INSTRUCTIONS,
+    EV_CACHE_REFS,
+    EV_CACHE_MISSES,
+    EV_BRANCHES,
+    EV_BRANCH_MISSES,
+    PSTAT_EVENTS
+};
+
+// Counters of one pstat stage
+struct counters {
+    int fd[PSTAT_EVENTS];  // perf_event_open() descriptors, -1 if unavailable
+    char command[ARGLEN];
+    struct timespec start;
+    struct timespec end;  // When the command was reaped
+};
+
+// Scheduling annotations of one pipeline stage: @cpus= @nice= @sched=
+struct sched_spec {
+    int has_cpus;
+    cpu_set_t cpus;
+    int has_nice;
+    int nice;
+    int policy;    // -1 keeps the shell's policy
+    int priority;  // For fifo and rr
+};
+
+// Enforces the wall-clock limit of one forked command
+struct watchdog {
+    pthread_t thread;
+    pid_t pid;
+    int pidfd;
+    int timerfd;
+    int sent;      // Last signal sent: 0, SIGTERM or SIGKILL
+    int detached;  // Background job: the thread reports and cleans up itself
+    struct limits limits;
+};
+
+// A builtin pipeline stage running on a thread of the shell
+struct stage_thread {
+    pthread_t thread;
+    const struct builtin* builtin;
+    char** argv;
+    struct builtin_io io;
+    int owned[MAXARGS * 2 + 2];  // Descriptors the stage closes when it is done
+    int owned_count;
+    int status;
+};
+
+// pprof relay between two pipeline stages
+struct relay {
+    pthread_t thread;
+    int in;              // Read end of the pipe the upstream stage writes
+    int out;             // Write end of the pipe the downstream stage reads
+    int pipe_size;
+    long long bytes;
+    double total_ms;     // Until the upstream stage closed its end
+    double full_ms;      // Waiting for room in the downstream pipe
+    double empty_ms;     // Waiting for input with the downstream pipe empty
+    double queued;       // FIONREAD of the downstream pipe summed over the samples
+    long samples;
+    int detached;        // 1: the job stopped and the thread frees itself; -1: the thread is done
+};
+
+// Descriptors replaced while a builtin or compound command runs with
+// redirections in the shell itself
+struct saved_fds {
+    int fd[MAXARGS * 2];
+    int copy[MAXARGS * 2];  // Saved copy of fd, or -1 if it was closed
+    int count;
+};
+
+// States of one process of a job
+enum { PROC_RUNNING, PROC_STOPPED, PROC_DONE };
+
+struct proc {
+    pid_t pid;
+    int state;
+    int status;              // Wait status of its last change
+    struct rusage usage;     // From wait4() once it is done
+    struct counters* counters;  // pstat counters, reported when the job is freed
+};
+
+// A pipeline or command started by the shell, in a process group of its
+// own when job control is on
+struct job {
+    int id;         // %N, 0 until it enters the job table
+    pid_t pgid;     // 0 without job control
+    char* command;  // Text for job listings
+    int reported;   // State last shown to the user
+    int has_tmodes;
+    struct termios tmodes;  // Terminal modes saved when it stopped
+    struct atomic_output* outputs;  // Its >! files, published when it is done
+    int count;
+    struct proc procs[];    // The last process gives the job's status
+};
+
+// Job control
+struct job* jobs[MAX_JOBS];  // jobs[i] is %(i + 1)
+int current_job = 0;         // %+, the job last stopped or started in the background
+int previous_job = 0;        // %-
+int job_control = 0;         // Interactive: jobs get process groups and the terminal
+int tty_fd = -1;             // The controlling terminal
+pid_t shell_pgid = 0;
+struct termios shell_tmodes;
+volatile sig_atomic_t children_changed = 0;
+static const int job_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, 0};
+
+// Interpreter state
+int last_status = 0;             // $?
+int subst_status = 0;            // Status of the last $(...) of the current command
+char* shell_name = "myshellv5";  // $0
+char** positional = NULL;        // $1, $2, ...
+int positional_count = 0;
+int loop_depth = 0;
+int break_levels = 0;            // Loops still to leave after break N
+int continue_levels = 0;         // Loops to unwind before continue N resumes one
+int returning = 0;               // return ran; unwind to the function call
+int return_status = 0;
+int interrupted = 0;             // A foreground job died of Ctrl-C; drop the rest of the line
+int tail_position = 0;           // Nothing runs after the next command, so it may replace the shell
+int embedded = 0;                // Linked into a host program through pucitsh.h
+int serving = 0;                 // A daemon worker, which replies to its client when the command line ends
+int exiting = 0;                 // exit ran where it must not end the process: stop reading input
+long fork_count = 0;             // Commands forked, reported with PUCITSH_STATS
+long forks_avoided = 0;          // Commands run in the shell or on a thread instead
+struct atomic_output* pending_outputs = NULL;  // >! files of commands still running in the shell
+struct var* var_table[VAR_BUCKETS];
+struct function* functions = NULL;
+
+#ifndef NO_MEMSTAT
+// Counters of one allocation category; the last entry of mem_stats[] sums
+// all of them. Updated atomically since stage and watchdog threads allocate too.
+struct mem_stats {
+    long allocs;
+    long frees;
+    size_t live;   // Bytes in use now
+    size_t peak;   // High-water mark of live
+    size_t total;  // Bytes allocated over the whole run
+};
+
+struct mem_stats mem_stats[MEM_CATEGORIES + 1];
+
+// Account size bytes (negative when freed) to a category and the total
+static void mem_account(int cat, long size, int allocs, int frees) {
+    struct mem_stats* targets[2] = {&mem_stats[cat], &mem_stats[MEM_CATEGORIES]};
+    for (int i = 0; i < 2; i++) {
+        struct mem_stats* st = targets[i];
+        size_t live = __atomic_add_fetch(&st->live, size, __ATOMIC_RELAXED);
+        size_t peak = __atomic_load_n(&st->peak, __ATOMIC_RELAXED);
+        while (live > peak && !__atomic_compare_exchange_n(&st->peak, &peak, live, 1, __ATOMIC_RELAXED,
+                                                           __ATOMIC_RELAXED)) {
+        }
+        if (size > 0) {
+            __atomic_add_fetch(&st->total, size, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&st->allocs, allocs, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&st->frees, frees, __ATOMIC_RELAXED);
+    }
+}
+
+// Sizes come from malloc_usable_size(), so blocks carry no header of their own
+void* mem_malloc(int cat, size_t n) {
+    void* p = malloc(n);
+    if (p != NULL) {
+        mem_account(cat, malloc_usable_size(p), 1, 0);
+    }
+    return p;
+}
+
+void* mem_calloc(int cat, size_t count, size_t n) {
+    void* p = calloc(count, n);
+    if (p != NULL) {
+        mem_account(cat, malloc_usable_size(p), 1, 0);
+    }
+    return p;
+}
+
+void* mem_realloc(int cat, void* p, size_t n) {
+    long old = p ? (long)malloc_usable_size(p) : 0;
+    void* q = realloc(p, n);
+    if (q != NULL) {
+        mem_account(cat, (long)malloc_usable_size(q) - old, p == NULL, 0);
+    }
+    return q;
+}
+
+char* mem_strdup(int cat, const char* s) {
+    return mem_strndup(cat, s, strlen(s));
+}
+
+char* mem_strndup(int cat, const char* s, size_t n) {
+    n = strnlen(s, n);
+    char* p = mem_malloc(cat, n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+void mem_free(int cat, void* p) {
+    if (p != NULL) {
+        mem_account(cat, -(long)malloc_usable_size(p), 0, 1);
+        free(p);
+    }
+}
+#endif
+
+// Signal handler for SIGCHLD: background jobs changed state. update_jobs()
+// reaps them before the next command, so no foreground status gets lost.
+void handle_sigchld(int sig) {
+    children_changed = 1;
+}
+
+#ifndef PUCITSH_LIB
+int main(int argc, char* argv[]) {
+    // Set up the signal handler to avoid zombie processes
+    struct sigaction sa;
+    sa.sa_handler = &handle_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // Serve command lines from other processes instead of a terminal
+    if (argc > 1 && strcmp(argv[1], "--daemon") == 0) {
+        return run_daemon(argc > 2 ? argv[2] : NULL);
+    }
+
+    // Commands come from -c, a script file, the terminal or piped input
+    struct input in = {0};
+    in.fd = -1;
+    shell_name = argv[0];
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        in.text = argv[2];
+        if (argc > 3) {
+            shell_name = argv[3];
+            positional = argv + 4;
+            positional_count = argc - 4;
+        }
+    } else if (argc > 1) {
+        in.fd = move_fd_high(open(argv[1], O_RDONLY | O_CLOEXEC));
+        if (in.fd < 0) {
+            perror(argv[1]);
+            return 127;
+        }
+        shell_name = argv[1];
+        positional = argv + 2;
+        positional_count = argc - 2;
+    } else if (isatty(STDIN_FILENO)) {
+        in.interactive = 1;
+        init_job_control();
+#ifndef BUILTIN_EDITOR
+        init_readline();
+#endif
+        run_rc_file();
+    } else {
+        in.fd = STDIN_FILENO;
+        in.unbuffered = 1;
+    }
+
+    in.audited = 1;
+    in.exec_last = !in.interactive;
+    int status = run_input(&in);
+    mem_free(MEM_PARSE, in.buf);
+    // PUCITSH_STATS reports how many commands ran without a fork of their own
+    if (!in.interactive && getenv("PUCITSH_STATS") != NULL) {
+        fprintf(stderr, "%s: %ld forks, %ld avoided by builtins\n", shell_name, fork_count, forks_avoided);
+    }
+    if (in.interactive) {
+        printf("\n");
+    }
+    return status;
+}
+#endif
+
+// Parse and run a command line given as text. Returns the exit status.
+int execute_cmdline(const char* cmdline) {
+    struct input in = {0};
+    in.fd = -1;
+    in.text = cmdline;
+    return run_input(&in);
+}
+
+// Quote and parenthesis nesting while scanning a command line. Inside
+// double quotes a "$(" opens a new level in which quotes start over.
+struct scan_state {
+    char stack[MAX_LEN];
+    int top;
+    int parens;  // Number of '(' levels on the stack
+};
+
+// Innermost open quote character, or 0 outside quotes
+static char scan_quote(struct scan_state* st) {
+    char c = st->top > 0 ? st->stack[st->top - 1] : 0;
+    return c == '(' ? 0 : c;
+}
+
+// Advance past character c (preceded by prev), updating the nesting
+static void scan_char(struct scan_state* st, char prev, char c) {
+    char inner = st->top > 0 ? st->stack[st->top - 1] : 0;
+    if (inner == '\'') {
+        if (c == '\'') {
+            st->top--;
+        }
+    } else if (inner == '"') {
+        if (c == '"') {
+            st->top--;
+        } else if (c == '(' && prev == '$' && st->top < MAX_LEN) {
+            st->stack[st->top++] = '(';
+            st->parens++;
+        }
+    } else if ((c == '\'' || c == '"' || c == '(') && st->top < MAX_LEN) {
+        st->stack[st->top++] = c;
+        if (c == '(') {
+            st->parens++;
+        }
+    } else if (c == ')' && inner == '(') {
+        st->top--;
+        st->parens--;
+    }
+}
+
+// Read the next line of input. first is set for the first line of a
+// command, which gets the main prompt and goes into the history.
+static char* input_line(struct input* in, int first) {
+    if (in->interactive) {
+        // The editor's line is copied so the lexer owns tracked memory
+        char* raw = read_cmd(first ? PROMPT : CONTINUE_PROMPT);
+        char* line = raw ? mem_strdup(MEM_PARSE, raw) : NULL;
+        free(raw);
+        if (line == NULL || !first) {
+            return line;
+        }
+        // !N runs a command from the history again
+        if (line[0] == '!' && isdigit((unsigned char)line[1])) {
+            int index = atoi(&line[1]);
+            const char* old = get_history_command(index);
+            mem_free(MEM_PARSE, line);
+            if (old == NULL) {
+                fprintf(stderr, "No such command in history: %d\n", index);
+                return mem_strdup(MEM_PARSE, "");
+            }
+            printf("%s\n", old);
+            line = mem_strdup(MEM_PARSE, old);
+        }
+        if (strspn(line, " \t") != strlen(line)) {
+            add_to_history(line);
+        }
+        return line;
+    }
+    if (in->fd >= 0) {
+        size_t cap = MAX_LEN, n = 0;
+        char* line = mem_malloc(MEM_PARSE, cap);
+        for (;;) {
+            if (in->pos == in->len) {
+                if (in->buf == NULL) {
+                    in->buf = mem_malloc(MEM_PARSE, INPUT_BUFFER);
+                }
+                ssize_t r = read(in->fd, in->buf, in->unbuffered ? 1 : INPUT_BUFFER);
+                if (r < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (r <= 0) {
+                    break;
+                }
+                in->len = r;
+                in->pos = 0;
+            }
+            char c = in->buf[in->pos++];
+            if (c == '\n') {
+                line[n] = '\0';
+                return line;
+            }
+            if (n + 1 >= cap) {
+                cap *= 2;
+                line = mem_realloc(MEM_PARSE, line, cap);
+            }
+            line[n++] = c;
+        }
+        if (n == 0) {
+            mem_free(MEM_PARSE, line);
+            return NULL;
+        }
+        line[n] = '\0';
+        return line;
+    }
+    if (in->text == NULL || *in->text == '\0') {
+        return NULL;
+    }
+    size_t n = strcspn(in->text, "\n");
+    char* line = mem_strndup(MEM_PARSE, in->text, n);
+    in->text += in->text[n] ? n + 1 : n;
+    return line;
+}
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Skip the blank lines and comments after a command. Returns 1 if nothing
+// else is left, so the command just parsed is the last of the input. Piped
+// standard input is never read ahead: its commands get the rest of it.
+static int input_at_end(struct input* in) {
+    if (in->interactive || (in->fd >= 0 && in->unbuffered)) {
+        return 0;
+    }
+    int comment = 0;
+    for (;;) {
+        char c;
+        if (in->fd < 0) {
+            if (in->text == NULL || *in->text == '\0') {
+                return 1;
+            }
+            c = *in->text;
+        } else {
+            if (in->pos == in->len) {
+                if (in->buf == NULL) {
+                    in->buf = mem_malloc(MEM_PARSE, INPUT_BUFFER);
+                }
+                ssize_t r = read(in->fd, in->buf, INPUT_BUFFER);
+                if (r < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (r <= 0) {
+                    return 1;
+                }
+                in->len = r;
+                in->pos = 0;
+            }
+            c = in->buf[in->pos];
+        }
+        if (comment) {
+            comment = c != '\n';
+        } else if (c == '#') {
+            comment = 1;
+        } else if (!is_blank(c) && c != '\n') {
+            return 0;
+        }
+        if (in->fd < 0) {
+            in->text++;
+        } else {
+            in->pos++;
+        }
+    }
+}
+
+// FNV-1a, the string hash of the variable, alias and history tables
+static uint32_t fnv_hash(const char* s) {
+    uint32_t h = 2166136261u;
+    for (; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+struct alias* alias_table;
+size_t alias_cap;    // Power of two
+size_t alias_count;  // Live aliases
+size_t alias_used;   // Slots that are not free, removed ones included
+static char alias_removed[] = "";
+
+// Slot of name: the alias itself, or the free slot where it would go
+static struct alias* alias_slot(const char* name) {
+    size_t i = fnv_hash(name) & (alias_cap - 1);
+    struct alias* removed = NULL;
+    for (;; i = (i + 1) & (alias_cap - 1)) {
+        struct alias* a = &alias_table[i];
+        if (a->name == NULL) {
+            return removed ? removed : a;
+        }
+        if (a->name == alias_removed) {
+            removed = removed ? removed : a;
+        } else if (strcmp(a->name, name) == 0) {
+            return a;
+        }
+    }
+}
+
+static struct alias* find_alias(const char* name) {
+    if (alias_count == 0) {
+        return NULL;
+    }
+    struct alias* a = alias_slot(name);
+    return a->name != NULL && a->name != alias_removed ? a : NULL;
+}
+
+static void set_alias(const char* name, const char* value) {
+    if ((alias_used + 1) * 4 > alias_cap * 3) {
+        // Rehash into a table twice the live count, which drops the removed slots
+        struct alias* old = alias_table;
+        size_t old_cap = alias_cap;
+        alias_cap = 16;
+        while (alias_cap < (alias_count + 1) * 2) {
+            alias_cap *= 2;
+        }
+        alias_table = mem_calloc(MEM_ENV, alias_cap, sizeof(struct alias));
+        alias_used = alias_count;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].name != NULL && old[i].name != alias_removed) {
+                *alias_slot(old[i].name) = old[i];
+            }
+        }
+        mem_free(MEM_ENV, old);
+    }
+    struct alias* a = alias_slot(name);
+    if (a->name == NULL || a->name == alias_removed) {
+        alias_used += a->name == NULL;
+        alias_count++;
+        a->name = mem_strdup(MEM_ENV, name);
+    } else {
+        mem_free(MEM_ENV, a->value);
+    }
+    a->value = mem_strdup(MEM_ENV, value);
+}
+
+static int remove_alias(const char* name) {
+    struct alias* a = find_alias(name);
+    if (a == NULL) {
+        return -1;
+    }
+    mem_free(MEM_ENV, a->name);
+    mem_free(MEM_ENV, a->value);
+    a->name = alias_removed;
+    a->value = NULL;
+    alias_count--;
+    return 0;
+}
+
+// Make sure the lexer has a line to scan; 0 at the end of the input
+static int lexer_fill(struct lexer* lx) {
+    if (lx->pos != NULL) {
+        return 1;
+    }
+    if (lx->eof) {
+        return 0;
+    }
+    mem_free(MEM_PARSE, lx->line);
+    lx->line = input_line(lx->in, !lx->continued);
+    lx->continued = 1;
+    if (lx->line == NULL) {
+        lx->eof = 1;
+        return 0;
+    }
+    lx->pos = lx->line;
+    return 1;
+}
+
+// Append the next input line to the current one for a word that is still
+// inside quotes or $(...) at the end of the line
+static int lexer_extend(struct lexer* lx) {
+    char* more = input_line(lx->in, 0);
+    if (more == NULL) {
+        return 0;
+    }
+    size_t len = strlen(lx->line);
+    lx->line = mem_realloc(MEM_PARSE, lx->line, len + strlen(more) + 2);
+    lx->line[len] = '\n';
+    strcpy(lx->line + len + 1, more);
+    mem_free(MEM_PARSE, more);
+    return 1;
+}
+
+// Read the bodies of the here-documents started on the line just scanned.
+// Each body is appended to its word, which becomes "<<DELIM\nbody".
+static void read_heredocs(struct lexer* lx) {
+    for (int i = 0; i < lx->heredoc_count; i++) {
+        char** word = &(*lx->heredoc_words[i])[lx->heredoc_index[i]];
+        int fd;
+        const char* op;
+        char delim[MAX_LEN];
+        int n = 0;
+        for (const char* p = *word + parse_redirect(*word, &fd, &op); *p && n < MAX_LEN - 1; p++) {
+            if (*p != '\'' && *p != '"') {
+                delim[n++] = *p;  // Quotes around the delimiter are dropped
+            }
+        }
+        delim[n] = '\0';
+
+        size_t len = strlen(*word), cap = len + MAX_LEN;
+        char* text = mem_malloc(MEM_PARSE, cap);
+        memcpy(text, *word, len);
+        text[len++] = '\n';
+        char* line;
+        while ((line = input_line(lx->in, 0)) != NULL && strcmp(line, delim) != 0) {
+            size_t ln = strlen(line);
+            while (len + ln + 2 > cap) {
+                cap *= 2;
+                text = mem_realloc(MEM_PARSE, text, cap);
+            }
+            memcpy(text + len, line, ln);
+            len += ln;
+            text[len++] = '\n';
+            mem_free(MEM_PARSE, line);
+        }
+        mem_free(MEM_PARSE, line);
+        text[len] = '\0';
+        mem_free(MEM_PARSE, *word);
+        *word = text;
+    }
+    lx->heredoc_count = 0;
+}
+
+// Scan one word. A redirection operator and its target become one word
+// ("> out" is returned as ">out") so the executor sees them together.
+static char* lex_word(struct lexer* lx) {
+    int fd;
+    const char* op;
+    int n = parse_redirect(lx->pos, &fd, &op);
+    char* prefix = mem_strndup(MEM_PARSE, lx->pos, n);
+    lx->pos += n;
+    if (n > 0) {
+        while (is_blank(*lx->pos)) {
+            lx->pos++;
+        }
+        if (*lx->pos == '\0' || strchr(";&|()<>", *lx->pos)) {
+            return prefix;  // No target; reported when the command runs
+        }
+    }
+
+    size_t start = lx->pos - lx->line, i = start;
+    struct scan_state st = {0};
+    for (;;) {
+        char c = lx->line[i];
+        if (c == '\0') {
+            // Quotes and $(...) may continue on the next line
+            if (st.top == 0 || lx->alias_depth > 0 || !lexer_extend(lx)) {
+                break;
+            }
+            continue;
+        }
+        if (st.top == 0) {
+            if (is_blank(c) || c == ';' || c == '&' || c == '|' || c == ')') {
+                break;
+            }
+            if (c == '(' && (i == start || !strchr("$<>", lx->line[i - 1]))) {
+                break;
+            }
+            if ((c == '<' || c == '>') && i > start && lx->line[i + 1] != '(') {
+                break;  // "a>b" is the word a followed by a redirection
+            }
+        }
+        scan_char(&st, i > start ? lx->line[i - 1] : 0, c);
+        i++;
+    }
+    lx->pos = lx->line + i;
+
+    size_t len = i - start;
+    char* word = mem_malloc(MEM_PARSE, n + len + 1);
+    memcpy(word, prefix, n);
+    memcpy(word + n, lx->line + start, len);
+    word[n + len] = '\0';
+    mem_free(MEM_PARSE, prefix);
+    return word;
+}
+
+static struct token* peek_token(struct lexer* lx);
+
+// Done with the innermost alias's text: go on after the word it replaced
+static void end_alias(struct lexer* lx) {
+    struct alias_frame* f = &lx->alias_stack[--lx->alias_depth];
+    size_t len = strlen(f->alias->value);
+    f->alias->expanding = 0;
+    lx->alias_next = len > 0 && is_blank(f->alias->value[len - 1]);
+    lx->line = f->line;
+    lx->pos = f->pos;
+}
+
+// If the peeked word is an alias, drop it and scan the alias's text in its
+// place, straight from the alias table. Returns 1 if it did.
+static int expand_alias(struct lexer* lx) {
+    struct token* t = peek_token(lx);
+    struct alias* a;
+    if (!lx->aliases || t->type != TOK_WORD || lx->alias_depth == ALIAS_DEPTH ||
+        (a = find_alias(t->word)) == NULL || a->expanding) {
+        return 0;
+    }
+    mem_free(MEM_PARSE, t->word);
+    lx->has_peeked = 0;
+    struct alias_frame* f = &lx->alias_stack[lx->alias_depth++];
+    f->line = lx->line;
+    f->pos = lx->pos;
+    f->alias = a;
+    a->expanding = 1;
+    lx->line = lx->pos = a->value;
+    lx->alias_next = 0;
+    return 1;
+}
+
+static struct token lex_token(struct lexer* lx) {
+    struct token tok = {TOK_EOF, NULL};
+    if (!lexer_fill(lx)) {
+        return tok;
+    }
+    for (;;) {
+        while (is_blank(*lx->pos)) {
+            lx->pos++;
+        }
+        if (*lx->pos == '#') {
+            lx->pos += strlen(lx->pos);  // Comment to the end of the line
+        }
+        if (*lx->pos != '\0' || lx->alias_depth == 0) {
+            break;
+        }
+        end_alias(lx);
+    }
+
+    char* p = lx->pos;
+    int len = 1;
+    if (*p == '\0') {
+        read_heredocs(lx);
+        lx->pos = NULL;
+        tok.type = TOK_NEWLINE;
+        return tok;
+    } else if (p[0] == '&' && p[1] == '&') {
+        tok.type = TOK_AND_IF;
+        len = 2;
+    } else if (p[0] == '|' && p[1] == '|') {
+        tok.type = TOK_OR_IF;
+        len = 2;
+    } else if (p[0] == '&' && p[1] != '>') {
+        tok.type = TOK_AMP;
+    } else if (p[0] == '|') {
+        tok.type = TOK_PIPE;
+    } else if (p[0] == ';') {
+        tok.type = TOK_SEMI;
+    } else if (p[0] == '(') {
+        tok.type = TOK_LPAREN;
+    } else if (p[0] == ')') {
+        tok.type = TOK_RPAREN;
+    } else {
+        tok.type = TOK_WORD;
+        tok.word = lex_word(lx);
+        return tok;
+    }
+    lx->pos += len;
+    return tok;
+}
+
+static struct token* peek_token(struct lexer* lx) {
+    if (!lx->has_peeked) {
+        lx->peeked = lex_token(lx);
+        lx->has_peeked = 1;
+    }
+    return &lx->peeked;
+}
+
+static struct token next_token(struct lexer* lx) {
+    peek_token(lx);
+    lx->has_peeked = 0;
+    return lx->peeked;
+}
+
+static int is_keyword(struct token* t, const char* kw) {
+    return t->type == TOK_WORD && strcmp(t->word, kw) == 0;
+}
+
+static void syntax_error(struct lexer* lx, struct token* t) {
+    static const char* names[] = {NULL, "newline", ";", "&", "|", "&&", "||", "(", ")", "end of file"};
+    if (!lx->error) {
+        fprintf(stderr, "syntax error near %s\n", t->type == TOK_WORD ? t->word : names[t->type]);
+    }
+    lx->error = 1;
+}
+
+// Consume the keyword kw or report a syntax error
+static int expect_keyword(struct lexer* lx, const char* kw) {
+    struct token* t = peek_token(lx);
+    if (!is_keyword(t, kw)) {
+        syntax_error(lx, t);
+        return 0;
+    }
+    mem_free(MEM_PARSE, next_token(lx).word);
+    return 1;
+}
+
+static void skip_newlines(struct lexer* lx) {
+    while (peek_token(lx)->type == TOK_NEWLINE) {
+        next_token(lx);
+    }
+}
+
+static struct node* new_node(enum node_type type) {
+    struct node* n = mem_calloc(MEM_PARSE, 1, sizeof(struct node));
+    n->type = type;
+    return n;
+}
+
+static void add_kid(struct node* n, struct node* kid) {
+    n->kids = mem_realloc(MEM_PARSE, n->kids, (n->kid_count + 1) * sizeof(struct node*));
+    n->kids[n->kid_count++] = kid;
+}
+
+// Append to a NULL-terminated word array
+static void add_word(char*** words, int* count, char* word) {
+    *words = mem_realloc(MEM_PARSE, *words, (*count + 2) * sizeof(char*));
+    (*words)[(*count)++] = word;
+    (*words)[*count] = NULL;
+}
+
+void free_node(struct node* n) {
+    if (n == NULL) {
+        return;
+    }
+    for (int i = 0; i < n->word_count; i++) {
+        mem_free(MEM_PARSE, n->words[i]);
+    }
+    for (int i = 0; i < n->redir_count; i++) {
+        mem_free(MEM_PARSE, n->redirs[i]);
+    }
+    for (int i = 0; i < n->kid_count; i++) {
+        free_node(n->kids[i]);
+    }
+    mem_free(MEM_PARSE, n->words);
+    mem_free(MEM_PARSE, n->redirs);
+    mem_free(MEM_PARSE, n->kids);
+    mem_free(MEM_PARSE, n->name);
+    mem_free(MEM_PARSE, n);
+}
+
+static char** copy_words(char** words, int count) {
+    if (words == NULL) {
+        return NULL;
+    }
+    char** copy = mem_malloc(MEM_PARSE, (count + 1) * sizeof(char*));
+    for (int i = 0; i < count; i++) {
+        copy[i] = mem_strdup(MEM_PARSE, words[i]);
+    }
+    copy[count] = NULL;
+    return copy;
+}
+
+// Deep copy of a tree, used to keep a function body past its definition
+static struct node* copy_node(struct node* n) {
+    struct node* c = new_node(n->type);
+    c->flags = n->flags;
+    c->name = n->name ? mem_strdup(MEM_PARSE, n->name) : NULL;
+    c->words = copy_words(n->words, n->word_count);
+    c->word_count = n->word_count;
+    c->redirs = copy_words(n->redirs, n->redir_count);
+    c->redir_count = n->redir_count;
+    for (int i = 0; i < n->kid_count; i++) {
+        add_kid(c, copy_node(n->kids[i]));
+    }
+    return c;
+}
+
+// Add a word to a command, remembering here-documents so their bodies are
+// read at the end of the line. The array is recorded rather than the word's
+// address because it may still be reallocated.
+static void add_command_word(struct lexer* lx, char*** words, int* count, char* word) {
+    int fd;
+    const char* op;
+    if (parse_redirect(word, &fd, &op) > 0 && strcmp(op, "<<") == 0 && lx->heredoc_count < MAXARGS) {
+        lx->heredoc_words[lx->heredoc_count] = words;
+        lx->heredoc_index[lx->heredoc_count++] = *count;
+    }
+    add_word(words, count, word);
+}
+
+// Redirections written after a compound command
+static void parse_redirects(struct lexer* lx, struct node* n) {
+    int fd;
+    const char* op;
+    while (peek_token(lx)->type == TOK_WORD && parse_redirect(peek_token(lx)->word, &fd, &op) > 0) {
+        add_command_word(lx, &n->redirs, &n->redir_count, next_token(lx).word);
+    }
+}
+
+static struct node* parse_list(struct lexer* lx, int top);
+static struct node* parse_command(struct lexer* lx);
+
+// Body of an if after the "if" or "elif" keyword. An elif becomes a nested
+// if in the else branch and consumes the shared "fi".
+static struct node* parse_if(struct lexer* lx) {
+    struct node* n = new_node(NODE_IF);
+    struct node* part = parse_list(lx, 0);
+    if (part == NULL || !expect_keyword(lx, "then")) {
+        free_node(part);
+        free_node(n);
+        return NULL;
+    }
+    add_kid(n, part);
+    if ((part = parse_list(lx, 0)) == NULL) {
+        free_node(n);
+        return NULL;
+    }
+    add_kid(n, part);
+    if (is_keyword(peek_token(lx), "elif")) {
+        mem_free(MEM_PARSE, next_token(lx).word);
+        if ((part = parse_if(lx)) == NULL) {
+            free_node(n);
+            return NULL;
+        }
+        add_kid(n, part);
+        return n;
+    }
+    if (is_keyword(peek_token(lx), "else")) {
+        mem_free(MEM_PARSE, next_token(lx).word);
+        if ((part = parse_list(lx, 0)) == NULL) {
+            free_node(n);
+            return NULL;
+        }
+        add_kid(n, part);
+    }
+    if (!expect_keyword(lx, "fi")) {
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+// "do list done" of a loop
+static struct node* parse_do_group(struct lexer* lx) {
+    skip_newlines(lx);
+    if (!expect_keyword(lx, "do")) {
+        return NULL;
+    }
+    struct node* body = parse_list(lx, 0);
+    if (body != NULL && !expect_keyword(lx, "done")) {
+        free_node(body);
+        return NULL;
+    }
+    return body;
+}
+
+static struct node* parse_while(struct lexer* lx, enum node_type type) {
+    struct node* n = new_node(type);
+    struct node* part = parse_list(lx, 0);
+    if (part == NULL) {
+        free_node(n);
+        return NULL;
+    }
+    add_kid(n, part);
+    if ((part = parse_do_group(lx)) == NULL) {
+        free_node(n);
+        return NULL;
+    }
+    add_kid(n, part);
+    return n;
+}
+
+static struct node* parse_for(struct lexer* lx) {
+    struct token* t = peek_token(lx);
+    if (t->type != TOK_WORD) {
+        syntax_error(lx, t);
+        return NULL;
+    }
+    struct node* n = new_node(NODE_FOR);
+    n->name = next_token(lx).word;
+    if (peek_token(lx)->type == TOK_SEMI) {
+        next_token(lx);
+    }
+    skip_newlines(lx);
+    if (is_keyword(peek_token(lx), "in")) {
+        mem_free(MEM_PARSE, next_token(lx).word);
+        add_word(&n->words, &n->word_count, NULL);  // Empty list, not "$@"
+        n->word_count = 0;
+        while (peek_token(lx)->type == TOK_WORD) {
+            add_word(&n->words, &n->word_count, next_token(lx).word);
+        }
+        t = peek_token(lx);
+        if (t->type != TOK_SEMI && t->type != TOK_NEWLINE) {
+            syntax_error(lx, t);
+            free_node(n);
+            return NULL;
+        }
+        next_token(lx);
+    } else {
+        n->flags |= NODE_ALL_ARGS;
+    }
+    struct node* body = parse_do_group(lx);
+    if (body == NULL) {
+        free_node(n);
+        return NULL;
+    }
+    add_kid(n, body);
+    return n;
+}
+
+// Function body after "name()" or "function name"
+static struct node* parse_function(struct lexer* lx, char* name) {
+    skip_newlines(lx);
+    struct node* body = parse_command(lx);
+    if (body == NULL) {
+        mem_free(MEM_PARSE, name);
+        return NULL;
+    }
+    struct node* n = new_node(NODE_FUNCTION);
+    n->name = name;
+    add_kid(n, body);
+    return n;
+}
+
+static struct node* parse_simple(struct lexer* lx) {
+    struct node* n = new_node(NODE_COMMAND);
+    while (peek_token(lx)->type == TOK_WORD) {
+        if (lx->alias_next && expand_alias(lx)) {
+            continue;  // The word after an alias ending in a blank
+        }
+        lx->alias_next = 0;
+        add_command_word(lx, &n->words, &n->word_count, next_token(lx).word);
+    }
+    if (n->word_count == 1 && peek_token(lx)->type == TOK_LPAREN) {
+        // name() body defines a function
+        next_token(lx);
+        struct token t = next_token(lx);
+        if (t.type != TOK_RPAREN) {
+            syntax_error(lx, &t);
+            mem_free(MEM_PARSE, t.word);
+            free_node(n);
+            return NULL;
+        }
+        char* name = n->words[0];
+        n->word_count = 0;
+        free_node(n);
+        return parse_function(lx, name);
+    }
+    return n;
+}
+
+static struct node* parse_command(struct lexer* lx) {
+    // The first word of a command may be an alias
+    while (expand_alias(lx)) {
+    }
+    lx->alias_next = 0;
+    struct token* t = peek_token(lx);
+    struct node* n = NULL;
+    struct node* body;
+    if (t->type == TOK_LPAREN) {
+        next_token(lx);
+        body = parse_list(lx, 0);
+        t = peek_token(lx);
+        if (body != NULL && t->type != TOK_RPAREN) {
+            syntax_error(lx, t);
+            free_node(body);
+            body = NULL;
+        }
+        if (body == NULL) {
+            return NULL;
+        }
+        next_token(lx);
+        n = new_node(NODE_SUBSHELL);
+        add_kid(n, body);
+    } else if (t->type != TOK_WORD) {
+        syntax_error(lx, t);
+        return NULL;
+    } else if (is_keyword(t, "if") || is_keyword(t, "while") || is_keyword(t, "until") ||
+               is_keyword(t, "for") || is_keyword(t, "{") || is_keyword(t, "function")) {
+        char* kw = next_token(lx).word;
+        if (strcmp(kw, "if") == 0) {
+            n = parse_if(lx);
+        } else if (strcmp(kw, "while") == 0) {
+            n = parse_while(lx, NODE_WHILE);
+        } else if (strcmp(kw, "until") == 0) {
+            n = parse_while(lx, NODE_UNTIL);
+        } else if (strcmp(kw, "for") == 0) {
+            n = parse_for(lx);
+        } else if (strcmp(kw, "{") == 0) {
+            body = parse_list(lx, 0);
+            if (body != NULL && expect_keyword(lx, "}")) {
+                n = new_node(NODE_GROUP);
+                add_kid(n, body);
+            } else {
+                free_node(body);
+            }
+        } else {
+            // function name [()] body
+            t = peek_token(lx);
+            if (t->type != TOK_WORD) {
+                syntax_error(lx, t);
+            } else {
+                char* name = next_token(lx).word;
+                if (peek_token(lx)->type == TOK_LPAREN) {
+                    next_token(lx);
+                    if (peek_token(lx)->type == TOK_RPAREN) {
+                        next_token(lx);
+                    } else {
+                        syntax_error(lx, peek_token(lx));
+                    }
+                }
+                n = lx->error ? (mem_free(MEM_PARSE, name), NULL) : parse_function(lx, name);
+            }
+        }
+        mem_free(MEM_PARSE, kw);
+        if (n == NULL || n->type == NODE_FUNCTION) {
+            return n;
+        }
+    } else {
+        return parse_simple(lx);
+    }
+    parse_redirects(lx, n);
+    return n;
+}
+
+static struct node* parse_pipeline(struct lexer* lx) {
+    int negate = 0;
+    if (is_keyword(peek_token(lx), "!")) {
+        mem_free(MEM_PARSE, next_token(lx).word);
+        negate = 1;
+    }
+    struct node* n = parse_command(lx);
+    if (n != NULL && peek_token(lx)->type == TOK_PIPE) {
+        struct node* pipeline = new_node(NODE_PIPELINE);
+        add_kid(pipeline, n);
+        while (peek_token(lx)->type == TOK_PIPE) {
+            next_token(lx);
+            skip_newlines(lx);
+            if ((n = parse_command(lx)) == NULL) {
+                free_node(pipeline);
+                return NULL;
+            }
+            add_kid(pipeline, n);
+        }
+        n = pipeline;
+    }
+    if (n != NULL && negate) {
+        n->flags |= NODE_NEGATE;
+    }
+    return n;
+}
+
+static struct node* parse_and_or(struct lexer* lx) {
+    struct node* left = parse_pipeline(lx);
+    while (left != NULL) {
+        enum token_type type = peek_token(lx)->type;
+        if (type != TOK_AND_IF && type != TOK_OR_IF) {
+            break;
+        }
+        next_token(lx);
+        skip_newlines(lx);
+        struct node* right = parse_pipeline(lx);
+        if (right == NULL) {
+            free_node(left);
+            return NULL;
+        }
+        struct node* n = new_node(type == TOK_AND_IF ? NODE_AND : NODE_OR);
+        add_kid(n, left);
+        add_kid(n, right);
+        left = n;
+    }
+    return left;
+}
+
+// Words that end a list inside a compound command
+static int is_list_end(struct token* t) {
+    static const char* ends[] = {"then", "elif", "else", "fi", "do", "done", "}", NULL};
+    if (t->type == TOK_EOF || t->type == TOK_RPAREN) {
+        return 1;
+    }
+    for (int i = 0; t->type == TOK_WORD && ends[i] != NULL; i++) {
+        if (strcmp(t->word, ends[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Commands separated by ; & or newlines. At the top level a newline ends
+// the list, so each line runs as soon as it has been read.
+static struct node* parse_list(struct lexer* lx, int top) {
+    struct node* list = new_node(NODE_LIST);
+    for (;;) {
+        if (!top) {
+            skip_newlines(lx);
+        }
+        struct token* t = peek_token(lx);
+        if (is_list_end(t) || t->type == TOK_NEWLINE) {
+            break;
+        }
+        struct node* item = parse_and_or(lx);
+        if (item == NULL) {
+            free_node(list);
+            return NULL;
+        }
+        add_kid(list, item);
+        t = peek_token(lx);
+        if (t->type == TOK_SEMI || t->type == TOK_AMP) {
+            if (t->type == TOK_AMP) {
+                item->flags |= NODE_BACKGROUND;
+            }
+            next_token(lx);
+        } else if (t->type != TOK_NEWLINE && !is_list_end(t)) {
+            syntax_error(lx, t);
+            free_node(list);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+// Parse the next command from the input: one line, or more while a
+// compound command, quote or here-document is unfinished. Returns NULL
+// after a syntax error; *eof is set at the end of the input.
+static struct node* parse_command_line(struct lexer* lx, int* eof) {
+    lx->continued = 0;
+    lx->error = 0;
+    struct node* n = parse_list(lx, 1);
+    struct token* t = peek_token(lx);
+    if (n != NULL && t->type != TOK_NEWLINE && t->type != TOK_EOF) {
+        syntax_error(lx, t);
+    }
+    if (lx->error) {
+        // Drop the rest of the line and start over
+        free_node(n);
+        n = NULL;
+        if (lx->has_peeked) {
+            mem_free(MEM_PARSE, lx->peeked.word);
+            lx->has_peeked = 0;
+        }
+        while (lx->alias_depth > 0) {
+            end_alias(lx);
+        }
+        lx->pos = NULL;
+        lx->heredoc_count = 0;
+        last_status = 2;
+    } else if (t->type == TOK_NEWLINE) {
+        next_token(lx);
+        t = NULL;
+    }
+    *eof = lx->error ? lx->eof : t != NULL;
+    return n;
+}
+
+// Whether the shell has nothing left to do once its last command is done:
+// no jobs to wait for or report, >! files to publish or fork counts to print
+static int nothing_after_last(void) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i] != NULL) {
+            return 0;
+        }
+    }
+    return pending_outputs == NULL && getenv("PUCITSH_STATS") == NULL;
+}
+
+// Parse and run every command of an input. Returns the last exit status.
+int run_input(struct input* in) {
+    struct lexer lx = {0};
+    lx.in = in;
+    lx.aliases = in->interactive;
+    int eof = 0;
+    while (!eof) {
+        update_jobs(in->interactive);
+        struct node* n = parse_command_line(&lx, &eof);
+        if (n != NULL && n->kid_count > 0) {
+            tail_position = in->exec_last && lx.pos == NULL && (eof || input_at_end(in)) &&
+                            !(in->audited && audit_wanted()) && nothing_after_last();
+            if (in->audited) {
+                audit_run(n);
+            } else {
+                run_node(n);
+            }
+        }
+        free_node(n);
+        if (in->sourced && returning) {
+            returning = 0;
+            last_status = return_status;
+            break;
+        }
+        if (in->sourced && (break_levels || continue_levels)) {
+            break;  // Left set for the loop around the source
+        }
+        if (exiting) {
+            break;
+        }
+        // break, continue or return outside of a loop or function
+        break_levels = continue_levels = returning = interrupted = 0;
+    }
+    mem_free(MEM_PARSE, lx.line);
+    return last_status;
+}
+
+static double elapsed_ms(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// The library runs no startup file
+#ifndef PUCITSH_LIB
+
+// Startup file cache. An interactive shell runs $PUCITSHRC or ~/.pucitshrc,
+// and saves the parsed commands to a cache file keyed by the file's path,
+// mtime and size and the build of the shell. While those match, later
+// shells map the cache and rebuild the trees without lexing or parsing.
+// The commands still run on every start, so exports, functions and
+// anything conditional come out the same as without the cache. A tree
+// holds the alias expansions of its parse, so each command is stored with
+// the aliases it was parsed under and its text. When the aliases defined
+// by the time it runs differ, as with an alias set only on some terminals,
+// that text is parsed again.
+struct rc_cache_header {
+    char magic[8];           // RC_CACHE_MAGIC
+    char build[24];          // __DATE__ " " __TIME__ of the shell that wrote it
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint32_t path_len;       // The startup file's path follows the header
+    uint32_t node_count;     // Then the commands: alias state, text, tree in preorder
+};
+
+// A command of the startup file
+struct rc_command {
+    struct node* tree;
+    char* text;         // The lines it was parsed from
+    uint32_t aliases;   // alias_state() when it was parsed
+};
+
+#define RC_CACHE_MAGIC "PUCITRC2"
+#define RC_CACHE_BUILD __DATE__ " " __TIME__
+
+// Hash of the alias table, the same for the same aliases in any order
+static uint32_t alias_state(void) {
+    uint32_t h = 0;
+    for (size_t i = 0; i < alias_cap; i++) {
+        struct alias* a = &alias_table[i];
+        if (a->name != NULL && a->name != alias_removed) {
+            h += (fnv_hash(a->name) * 2654435761u) ^ fnv_hash(a->value);
+        }
+    }
+    return h;
+}
+
+// Cache file of a startup file: $XDG_CACHE_HOME or ~/.cache, then
+// pucitsh/rc-<hash of the path>
+static int rc_cache_path(const char* rc, char* path, size_t size) {
+    const char* base = get_var("XDG_CACHE_HOME");
+    const char* home = get_var("HOME");
+    char dir[MAX_LEN];
+    if (base != NULL && base[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/pucitsh", base);
+    } else if (home != NULL) {
+        snprintf(dir, sizeof(dir), "%s/.cache/pucitsh", home);
+    } else {
+        return -1;
+    }
+    return snprintf(path, size, "%s/rc-%08x", dir, fnv_hash(rc)) < (int)size ? 0 : -1;
+}
+
+static void put_u32(FILE* f, uint32_t v) {
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+// A string as its length and bytes; UINT32_MAX stands for NULL
+static void put_string(FILE* f, const char* s) {
+    put_u32(f, s ? strlen(s) : UINT32_MAX);
+    if (s != NULL) {
+        fwrite(s, 1, strlen(s), f);
+    }
+}
+
+// A word array as its count plus one, 0 for a NULL array, then the words
+static void put_words(FILE* f, char** words, int count) {
+    put_u32(f, words ? count + 1 : 0);
+    for (int i = 0; words && i < count; i++) {
+        put_string(f, words[i]);
+    }
+}
+
+static void put_node(FILE* f, struct node* n) {
+    put_u32(f, n->type);
+    put_u32(f, n->flags);
+    put_string(f, n->name);
+    put_words(f, n->words, n->word_count);
+    put_words(f, n->redirs, n->redir_count);
+    put_u32(f, n->kid_count);
+    for (int i = 0; i < n->kid_count; i++) {
+        put_node(f, n->kids[i]);
+    }
+}
+
+// Write the cache to a temporary file and rename it into place, so a
+// shell starting at the same time never maps half a cache
+static void save_rc_cache(const char* cache, const char* rc, const struct stat* st, struct rc_command* cmds, int count) {
+    char dir[MAX_LEN], tmp[MAX_LEN + 32];
+    snprintf(dir, sizeof(dir), "%s", cache);
+    *strrchr(dir, '/') = '\0';
+    if (mkdir(dir, 0700) < 0 && errno == ENOENT) {
+        // ~/.cache itself may be missing
+        char* slash = strrchr(dir, '/');
+        *slash = '\0';
+        mkdir(dir, 0700);
+        *slash = '/';
+        mkdir(dir, 0700);
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid());
+    FILE* f = fopen(tmp, "we");
+    if (f == NULL) {
+        return;  // No cache then; the file is parsed again next time
+    }
+    struct rc_cache_header h = {0};
+    memcpy(h.magic, RC_CACHE_MAGIC, sizeof(h.magic));
+    snprintf(h.build, sizeof(h.build), "%s", RC_CACHE_BUILD);
+    h.mtime_sec = st->st_mtim.tv_sec;
+    h.mtime_nsec = st->st_mtim.tv_nsec;
+    h.size = st->st_size;
+    h.path_len = strlen(rc);
+    h.node_count = count;
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(rc, 1, h.path_len, f);
+    for (int i = 0; i < count; i++) {
+        put_u32(f, cmds[i].aliases);
+        put_string(f, cmds[i].text);
+        put_node(f, cmds[i].tree);
+    }
+    if (fclose(f) != 0 || rename(tmp, cache) < 0) {
+        unlink(tmp);
+    }
+}
+
+// Cursor over a mapped cache; bad is set when it runs past the end
+struct rc_reader {
+    const char* p;
+    const char* end;
+    int bad;
+};
+
+static uint32_t get_u32(struct rc_reader* r) {
+    uint32_t v = 0;
+    if ((size_t)(r->end - r->p) < sizeof(v)) {
+        r->bad = 1;
+        return 0;
+    }
+    memcpy(&v, r->p, sizeof(v));
+    r->p += sizeof(v);
+    return v;
+}
+
+static char* get_string(struct rc_reader* r) {
+    uint32_t len = get_u32(r);
+    if (len == UINT32_MAX || r->bad) {
+        return NULL;
+    }
+    if ((size_t)(r->end - r->p) < len) {
+        r->bad = 1;
+        return NULL;
+    }
+    char* s = mem_strndup(MEM_PARSE, r->p, len);
+    r->p += len;
+    return s;
+}
+
+static char** get_words(struct rc_reader* r, int* count) {
+    uint32_t n = get_u32(r);
+    *count = 0;
+    if (n == 0 || n > (size_t)(r->end - r->p) / sizeof(uint32_t) + 1) {
+        r->bad |= n != 0;
+        return NULL;
+    }
+    char** words = mem_malloc(MEM_PARSE, n * sizeof(char*));
+    words[0] = NULL;
+    for (uint32_t i = 0; i + 1 < n && !r->bad; i++) {
+        char* word = get_string(r);
+        words[i] = word ? word : mem_strdup(MEM_PARSE, "");
+        words[i + 1] = NULL;
+        (*count)++;
+    }
+    return words;
+}
+
+static struct node* get_node(struct rc_reader* r) {
+    uint32_t type = get_u32(r);
+    if (r->bad || type > NODE_FUNCTION) {
+        r->bad = 1;
+        return NULL;
+    }
+    struct node* n = new_node(type);
+    n->flags = get_u32(r);
+    n->name = get_string(r);
+    n->words = get_words(r, &n->word_count);
+    n->redirs = get_words(r, &n->redir_count);
+    uint32_t kids = get_u32(r);
+    for (uint32_t i = 0; i < kids && !r->bad; i++) {
+        struct node* kid = get_node(r);
+        if (kid != NULL) {
+            add_kid(n, kid);
+        }
+    }
+    return n;
+}
+
+static void free_rc_commands(struct rc_command* cmds, int count) {
+    for (int i = 0; i < count; i++) {
+        free_node(cmds[i].tree);
+        mem_free(MEM_PARSE, cmds[i].text);
+    }
+    mem_free(MEM_PARSE, cmds);
+}
+
+// Map the cache and rebuild its commands if it was written by this build
+// for the startup file as it is now. Returns NULL if it cannot be used.
+static struct rc_command* load_rc_cache(const char* cache, const char* rc, const struct stat* st, int* count) {
+    int fd = open(cache, O_RDONLY | O_CLOEXEC);
+    struct stat cst;
+    if (fd < 0 || fstat(fd, &cst) < 0 || cst.st_size < (off_t)sizeof(struct rc_cache_header)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    char* map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    struct rc_cache_header h;
+    memcpy(&h, map, sizeof(h));
+    struct rc_reader r = {map + sizeof(h), map + cst.st_size, 0};
+    char build[sizeof(h.build)] = {0};
+    snprintf(build, sizeof(build), "%s", RC_CACHE_BUILD);
+    struct rc_command* cmds = NULL;
+    if (memcmp(h.magic, RC_CACHE_MAGIC, sizeof(h.magic)) == 0 && memcmp(h.build, build, sizeof(build)) == 0 &&
+        h.mtime_sec == st->st_mtim.tv_sec && h.mtime_nsec == st->st_mtim.tv_nsec && h.size == st->st_size &&
+        h.path_len == strlen(rc) && (size_t)(r.end - r.p) >= h.path_len && memcmp(r.p, rc, h.path_len) == 0 &&
+        h.node_count <= (size_t)(r.end - r.p)) {
+        r.p += h.path_len;
+        cmds = mem_calloc(MEM_PARSE, h.node_count + 1, sizeof(struct rc_command));
+        for (*count = 0; *count < (int)h.node_count && !r.bad; (*count)++) {
+            cmds[*count].aliases = get_u32(&r);
+            cmds[*count].text = get_string(&r);
+            cmds[*count].tree = get_node(&r);
+        }
+        if (r.bad || r.p != r.end) {
+            // Truncated or corrupt: parse the file instead
+            free_rc_commands(cmds, *count);
+            cmds = NULL;
+        }
+    }
+    munmap(map, cst.st_size);
+    return cmds;
+}
+
+// Parse and run startup file text a command at a time, like run_input(),
+// so aliases it defines apply to its later lines. The commands are kept
+// for the cache; *errors is set after a syntax error so that none is written.
+static struct rc_command* parse_rc_text(const char* text, int* count, int* errors, double* parse_ms) {
+    struct input in = {0};
+    in.fd = -1;
+    in.text = text;
+    struct lexer lx = {0};
+    lx.in = &in;
+    lx.aliases = 1;
+    struct rc_command* cmds = NULL;
+    int eof = 0;
+    *count = *errors = 0;
+    while (!eof) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        const char* from = in.text;
+        uint32_t aliases = alias_state();
+        struct node* n = parse_command_line(&lx, &eof);
+        *parse_ms += elapsed_ms(&start);
+        *errors |= lx.error;
+        if (n != NULL && n->kid_count > 0) {
+            audit_run(n);
+            break_levels = continue_levels = returning = interrupted = 0;
+            cmds = mem_realloc(MEM_PARSE, cmds, (*count + 1) * sizeof(struct rc_command));
+            cmds[*count] = (struct rc_command){n, mem_strndup(MEM_PARSE, from, in.text - from), aliases};
+            (*count)++;
+        } else {
+            free_node(n);
+        }
+    }
+    mem_free(MEM_PARSE, lx.line);
+    return cmds;
+}
+
+// Run the startup file of an interactive shell, from the cache if it is
+// current. PUCITSH_STATS reports which way it went and how long parsing or
+// loading took.
+static void run_rc_file(void) {
+    char rc[MAX_LEN], cache[MAX_LEN];
+    const char* path = get_var("PUCITSHRC");
+    const char* home = get_var("HOME");
+    if (path != NULL) {
+        snprintf(rc, sizeof(rc), "%s", path);
+    } else if (home != NULL) {
+        snprintf(rc, sizeof(rc), "%s/.pucitshrc", home);
+    } else {
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int fd = move_fd_high(open(rc, O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    int count = 0, errors = 0, reparsed = 0, has_cache = rc_cache_path(rc, cache, sizeof(cache)) == 0;
+    struct rc_command* cmds = has_cache ? load_rc_cache(cache, rc, &st, &count) : NULL;
+    double ms = elapsed_ms(&start);
+    int cached = cmds != NULL;
+    if (cached) {
+        for (int i = 0; i < count; i++) {
+            if (cmds[i].aliases == alias_state()) {
+                audit_run(cmds[i].tree);
+                break_levels = continue_levels = returning = interrupted = 0;
+            } else {
+                // Other aliases than when it was cached: expand them now
+                int n, bad;
+                struct rc_command* again = parse_rc_text(cmds[i].text ? cmds[i].text : "", &n, &bad, &ms);
+                free_rc_commands(again, n);
+                reparsed++;
+            }
+        }
+    } else {
+        char* text = mem_malloc(MEM_PARSE, st.st_size + 1);
+        ssize_t len = 0, r;
+        while (len < st.st_size && ((r = read(fd, text + len, st.st_size - len)) > 0 || (r < 0 && errno == EINTR))) {
+            len += r > 0 ? r : 0;
+        }
+        text[len] = '\0';
+        cmds = parse_rc_text(text, &count, &errors, &ms);
+        mem_free(MEM_PARSE, text);
+        if (has_cache && !errors) {
+            save_rc_cache(cache, rc, &st, cmds, count);
+        }
+    }
+    close(fd);
+    if (getenv("PUCITSH_STATS") != NULL) {
+        fprintf(stderr, "%s: %d commands %s in %.3f ms", rc, count, cached ? "mapped from the cache" : "parsed", ms);
+        fprintf(stderr, reparsed ? ", %d parsed again for their aliases\n" : "\n", reparsed);
+    }
+    free_rc_commands(cmds, count);
+}
+#endif
+
+static struct var* find_var(const char* name, unsigned int* bucket) {
+    *bucket = fnv_hash(name) % VAR_BUCKETS;
+    for (struct var* v = var_table[*bucket]; v != NULL; v = v->next) {
+        if (strcmp(v->name, name) == 0) {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// Value of a shell variable, falling back to the environment; NULL if unset
+const char* get_var(const char* name) {
+    unsigned int bucket;
+    struct var* v = find_var(name, &bucket);
+    return v ? v->value : getenv(name);
+}
+
+void set_var(const char* name, const char* value) {
+    unsigned int bucket;
+    struct var* v = find_var(name, &bucket);
+    if (v == NULL) {
+        v = mem_calloc(MEM_ENV, 1, sizeof(struct var));
+        v->name = mem_strdup(MEM_ENV, name);
+        v->exported = getenv(name) != NULL;
+        v->next = var_table[bucket];
+        var_table[bucket] = v;
+    }
+    // value may be the old one, as in "export NAME"
+    char* old = v->value;
+    v->value = mem_strdup(MEM_ENV, value);
+    mem_free(MEM_ENV, old);
+    if (v->exported) {
+        setenv(name, v->value, 1);
+    }
+}
+
+static void unset_var(const char* name) {
+    unsigned int bucket;
+    struct var* v = find_var(name, &bucket);
+    if (v != NULL) {
+        struct var** link = &var_table[bucket];
+        while (*link != v) {
+            link = &(*link)->next;
+        }
+        *link = v->next;
+        mem_free(MEM_ENV, v->name);
+        mem_free(MEM_ENV, v->value);
+        mem_free(MEM_ENV, v);
+    }
+    unsetenv(name);
+}
+
+static int is_name_char(char c, int first) {
+    return c == '_' || isalpha((unsigned char)c) || (!first && isdigit((unsigned char)c));
+}
+
+// NAME=value word at the start of a simple command
+static int is_assignment(const char* word) {
+    if (!is_name_char(word[0], 1)) {
+        return 0;
+    }
+    const char* p = word + 1;
+    while (is_name_char(*p, 0)) {
+        p++;
+    }
+    return *p == '=';
+}
+
+// Set the variable of an expanded NAME=value word
+static void assign(char* word) {
+    char* eq = strchr(word, '=');
+    *eq = '\0';
+    set_var(word, eq + 1);
+    *eq = '=';
+}
+
+static struct function* find_function(const char* name) {
+    for (struct function* f = functions; f != NULL; f = f->next) {
+        if (strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static void define_function(const char* name, struct node* body) {
+    struct function* f = find_function(name);
+    if (f == NULL) {
+        f = mem_calloc(MEM_ENV, 1, sizeof(struct function));
+        f->name = mem_strdup(MEM_ENV, name);
+        f->next = functions;
+        functions = f;
+    } else {
+        free_node(f->body);
+    }
+    f->body = copy_node(body);
+}
+
+static int call_function(struct function* f, char** argv) {
+    char** saved_args = positional;
+    int saved_count = positional_count, saved_depth = loop_depth;
+    positional = argv + 1;
+    for (positional_count = 0; positional[positional_count] != NULL; positional_count++) {
+    }
+    loop_depth = 0;  // break in a function does not leave the caller's loops
+    int status = run_node(f->body);
+    if (returning) {
+        status = return_status;
+        returning = 0;
+    }
+    positional = saved_args;
+    positional_count = saved_count;
+    loop_depth = saved_depth;
+    return status;
+}
+
+static int builtin_cd(char** argv, struct builtin_io* io) {
+    if (argv[1] == NULL) {
+        fprintf(stderr, "cd: missing argument\n");
+        return 1;
+    }
+    if (chdir(argv[1]) != 0) {
+        perror("cd failed");
+        return 1;
+    }
+    return 0;
+}
+
+static int builtin_exit(char** argv, struct builtin_io* io) {
+    int status = argv[1] ? atoi(argv[1]) : last_status;
+    if (embedded || serving) {
+        // The host goes on, and a daemon worker still has to reply
+        interrupted = exiting = 1;
+        return status;
+    }
+    fflush(stdout);
+    exit(status);
+}
+
+// Counters pstat opens on each measured command
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} pstat_events[PSTAT_EVENTS] = {
+    [EV_TASK_CLOCK] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    [EV_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [EV_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [EV_CACHE_REFS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    [EV_CACHE_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [EV_BRANCHES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    [EV_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+// Open the pstat counters on a forked child that is still waiting to exec.
+// They start counting at its exec (enable_on_exec) and follow its own
+// children (inherit). Counters the machine or container lacks stay -1.
+static struct counters* open_counters(pid_t pid, const char* command) {
+    struct counters* c = mem_calloc(MEM_JOBS, 1, sizeof(struct counters));
+    snprintf(c->command, sizeof(c->command), "%s", command);
+    clock_gettime(CLOCK_MONOTONIC, &c->start);
+    for (int e = 0; e < PSTAT_EVENTS; e++) {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = pstat_events[e].type;
+        attr.config = pstat_events[e].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1;
+        c->fd[e] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (c->fd[e] < 0 && (errno == EACCES || errno == EPERM)) {
+            // perf_event_paranoid may still allow counting user space only
+            attr.exclude_kernel = attr.exclude_hv = 1;
+            c->fd[e] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+        c->fd[e] = move_fd_high(c->fd[e]);
+    }
+    return c;
+}
+
+// Value of one counter, scaled up if it shared the PMU with others; -1 if
+// it could not be opened or never ran
+static double read_counter(int fd) {
+    uint64_t v[3];  // Value, time enabled, time running
+    if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v) || v[1] == 0) {
+        return -1;
+    }
+    return v[2] > 0 && v[2] < v[1] ? (double)v[0] * v[1] / v[2] : (double)v[0];
+}
+
+// Print the exit record of a pstat command: IPC and miss rates from the
+// counters, or its rusage when the counters are unavailable (containers,
+// virtual machines, perf_event_paranoid) or it never reached exec
+static void report_counters(struct counters* c, const struct rusage* ru) {
+    double v[PSTAT_EVENTS];
+    for (int e = 0; e < PSTAT_EVENTS; e++) {
+        v[e] = read_counter(c->fd[e]);
+        if (c->fd[e] >= 0) {
+            close(c->fd[e]);
+        }
+    }
+    if (c->end.tv_sec == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &c->end);
+    }
+    double wall = (c->end.tv_sec - c->start.tv_sec) + (c->end.tv_nsec - c->start.tv_nsec) / 1e9;
+
+    char line[MAX_LEN];
+    int len = snprintf(line, sizeof(line), "pstat: %s: %.3fs real", c->command, wall);
+    if (v[EV_TASK_CLOCK] >= 0) {
+        len += snprintf(line + len, sizeof(line) - len, ", %.1f ms task-clock, %.2f CPUs", v[EV_TASK_CLOCK] / 1e6,
+                        wall > 0 ? v[EV_TASK_CLOCK] / 1e9 / wall : 0);
+    }
+    if (v[EV_CYCLES] > 0 && v[EV_INSTRUCTIONS] >= 0) {
+        len += snprintf(line + len, sizeof(line) - len, ", %.3g cycles, %.3g instructions, %.2f IPC", v[EV_CYCLES],
+                        v[EV_INSTRUCTIONS], v[EV_INSTRUCTIONS] / v[EV_CYCLES]);
+    }
+    if (v[EV_CACHE_REFS] > 0 && v[EV_CACHE_MISSES] >= 0) {
+        len += snprintf(line + len, sizeof(line) - len, ", %.2f%% cache misses",
+                        100 * v[EV_CACHE_MISSES] / v[EV_CACHE_REFS]);
+    }
+    if (v[EV_BRANCHES] > 0 && v[EV_BRANCH_MISSES] >= 0) {
+        len += snprintf(line + len, sizeof(line) - len, ", %.2f%% branch misses",
+                        100 * v[EV_BRANCH_MISSES] / v[EV_BRANCHES]);
+    }
+    if (v[EV_CYCLES] < 0 && len < (int)sizeof(line)) {
+        // No hardware counters here: fall back to what wait4() reported
+        snprintf(line + len, sizeof(line) - len,
+                 ", %.3fs user, %.3fs sys, %ldK max RSS, %ld/%ld major/minor faults, %ld/%ld vol/invol switches (rusage)",
+                 ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6, ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+                 ru->ru_maxrss, ru->ru_majflt, ru->ru_minflt, ru->ru_nvcsw, ru->ru_nivcsw);
+    }
+    fprintf(stderr, "%s\n", line);
+    mem_free(MEM_JOBS, c);
+}
+
+// Exit status of a process the shell waited for
+static int wait_status(int st) {
+    if (WIFSTOPPED(st)) {
+        return 128 + WSTOPSIG(st);
+    }
+    return WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+}
+
+#ifndef PUCITSH_LIB
+// Take the terminal for job control: wait until the shell is in the
+// foreground, move it into a process group of its own and ignore the
+// signals the terminal sends to the foreground job
+static void init_job_control(void) {
+    int fd = move_fd_high(fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0));
+    if (fd < 0) {
+        return;
+    }
+    pid_t pgrp;
+    while (tcgetpgrp(fd) != (pgrp = getpgrp())) {
+        kill(-pgrp, SIGTTIN);
+    }
+    for (int i = 0; job_signals[i] != 0; i++) {
+        signal(job_signals[i], SIG_IGN);
+    }
+    if (getsid(0) != getpid()) {
+        setpgid(0, 0);  // A session leader already leads its group
+    }
+    shell_pgid = getpgrp();
+    tcsetpgrp(fd, shell_pgid);
+    tcgetattr(fd, &shell_tmodes);
+    tty_fd = fd;
+    job_control = 1;
+}
+#endif
+
+// In a forked child that starts a job: join the job's process group
+// (pgid 0 makes a new one) and take the terminal for a foreground job
+static void enter_job(pid_t pgid, int foreground) {
+    if (!job_control) {
+        return;
+    }
+    setpgid(0, pgid);
+    if (foreground) {
+        tcsetpgrp(tty_fd, pgid ? pgid : getpid());
+    }
+}
+
+// In a forked child: the parent's jobs are not ours, and the commands we
+// run get the default job control signals back
+static void forget_jobs(void) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i] != NULL) {
+            for (int k = 0; k < jobs[i]->count; k++) {
+                mem_free(MEM_JOBS, jobs[i]->procs[k].counters);
+            }
+            mem_free(MEM_JOBS, jobs[i]->command);
+            mem_free(MEM_JOBS, jobs[i]);
+            jobs[i] = NULL;
+        }
+    }
+    if (job_control) {
+        for (int i = 0; job_signals[i] != 0; i++) {
+            signal(job_signals[i], SIG_DFL);
+        }
+        job_control = 0;
+    }
+}
+
+// End a forked child. In a host program exit() would also run the host's
+// atexit handlers and C++ destructors, so only our output is flushed.
+static void exit_child(int status) {
+    if (embedded) {
+        fflush(stdout);
+        fflush(stderr);
+        _exit(status);
+    }
+    exit(status);
+}
+
+// Short text of a command for job listings
+static void node_text(struct node* n, char* buf, size_t size) {
+    size_t len = strlen(buf);
+    switch (n->type) {
+    case NODE_COMMAND:
+        for (int i = 0; i < n->word_count && len < size; i++) {
+            // A here-document word carries its body after a newline
+            len += snprintf(buf + len, size - len, "%s%.*s", i ? " " : "", (int)strcspn(n->words[i], "\n"),
+                            n->words[i]);
+        }
+        return;
+    case NODE_PIPELINE:
+    case NODE_AND:
+    case NODE_OR:
+        for (int i = 0; i < n->kid_count && strlen(buf) < size - 1; i++) {
+            if (i > 0) {
+                snprintf(buf + strlen(buf), size - strlen(buf), "%s",
+                         n->type == NODE_PIPELINE ? " | " : n->type == NODE_AND ? " && " : " || ");
+            }
+            node_text(n->kids[i], buf, size);
+        }
+        return;
+    default: {
+        static const char* names[] = {
+            [NODE_LIST] = "...", [NODE_IF] = "if ...", [NODE_WHILE] = "while ...", [NODE_UNTIL] = "until ...",
+            [NODE_FOR] = "for ...", [NODE_GROUP] = "{ ... }", [NODE_SUBSHELL] = "( ... )", [NODE_FUNCTION] = "...",
+        };
+        snprintf(buf + len, size - len, "%s", names[n->type]);
+    }
+    }
+}
+
+// New job of count processes; it enters the job table with add_job()
+static struct job* new_job(pid_t pgid, const pid_t* pids, int count, struct node** nodes, int node_count) {
+    struct job* j = mem_calloc(MEM_JOBS, 1, sizeof(struct job) + count * sizeof(struct proc));
+    char text[MAX_LEN] = "";
+    for (int i = 0; i < node_count; i++) {
+        if (i > 0) {
+            snprintf(text + strlen(text), sizeof(text) - strlen(text), " | ");
+        }
+        node_text(nodes[i], text, sizeof(text));
+    }
+    j->command = mem_strdup(MEM_JOBS, text);
+    j->pgid = pgid;
+    j->count = count;
+    for (int i = 0; i < count; i++) {
+        j->procs[i].pid = pids[i];
+    }
+    return j;
+}
+
+static int job_state(const struct job* j);
+
+// Remove a job from the table and free it, printing its pstat records and
+// publishing or discarding its >! files
+static void free_job(struct job* j) {
+    if (j->id > 0) {
+        jobs[j->id - 1] = NULL;
+    }
+    for (int k = 0; k < j->count; k++) {
+        if (j->procs[k].counters != NULL) {
+            report_counters(j->procs[k].counters, &j->procs[k].usage);
+        }
+    }
+    int status = job_state(j) == PROC_DONE ? wait_status(j->procs[j->count - 1].status) : 1;
+    while (j->outputs != NULL) {
+        struct atomic_output* o = j->outputs;
+        j->outputs = o->next;
+        finish_atomic_output(o, status);
+    }
+    mem_free(MEM_JOBS, j->command);
+    mem_free(MEM_JOBS, j);
+}
+
+// Give the job the lowest free number and make it the current job
+static int add_job(struct job* j) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i] == NULL) {
+            jobs[i] = j;
+            j->id = i + 1;
+            attach_spool(j->id);
+            previous_job = current_job;
+            current_job = j->id;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Too many jobs\n");
+    return -1;
+}
+
+// PROC_RUNNING while any process runs, else PROC_STOPPED while any is stopped
+static int job_state(const struct job* j) {
+    int state = PROC_DONE;
+    for (int i = 0; i < j->count; i++) {
+        if (j->procs[i].state == PROC_RUNNING) {
+            return PROC_RUNNING;
+        }
+        if (j->procs[i].state == PROC_STOPPED) {
+            state = PROC_STOPPED;
+        }
+    }
+    return state;
+}
+
+// Record a status change from wait4() in the job that owns pid. The job
+// being waited for is checked first; it is not in the table yet.
+static void record_status(pid_t pid, int st, const struct rusage* ru, struct job* waiting) {
+    for (int i = -1; i < MAX_JOBS; i++) {
+        struct job* j = i < 0 ? waiting : jobs[i];
+        for (int k = 0; j != NULL && k < j->count; k++) {
+            if (j->procs[k].pid == pid) {
+                j->procs[k].state = WIFSTOPPED(st) ? PROC_STOPPED : WIFCONTINUED(st) ? PROC_RUNNING : PROC_DONE;
+                j->procs[k].status = st;
+                j->procs[k].usage = *ru;
+                if (j->procs[k].state == PROC_DONE && j->procs[k].counters != NULL) {
+                    clock_gettime(CLOCK_MONOTONIC, &j->procs[k].counters->end);
+                }
+                return;
+            }
+        }
+    }
+}
+
+// Wait until no process of the job runs any more. Other children that
+// change state meanwhile are recorded in their own jobs.
+static void wait_job(struct job* j) {
+    while (job_state(j) == PROC_RUNNING) {
+        int st;
+        struct rusage ru;
+        pid_t target = -1;  // Any child, but a host program's children are not ours to reap
+        for (int k = 0; embedded && target < 0 && k < j->count; k++) {
+            if (j->procs[k].state == PROC_RUNNING) {
+                target = j->procs[k].pid;
+            }
+        }
+        pid_t pid = wait4(target, &st, job_control ? WUNTRACED : 0, &ru);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            for (int k = 0; k < j->count; k++) {
+                j->procs[k].state = PROC_DONE;  // Reaped elsewhere: nothing is left to wait for
+            }
+            break;
+        }
+        record_status(pid, st, &ru, j);
+    }
+}
+
+// Send sig to every process of the job: one killpg() for its process group
+static int signal_job(struct job* j, int sig) {
+    if (j->pgid > 0) {
+        return killpg(j->pgid, sig);
+    }
+    for (int k = 0; k < j->count; k++) {
+        if (j->procs[k].state != PROC_DONE) {
+            kill(j->procs[k].pid, sig);
+        }
+    }
+    return 0;
+}
+
+// Continue a stopped job
+static void continue_job(struct job* j) {
+    for (int k = 0; k < j->count; k++) {
+        if (j->procs[k].state == PROC_STOPPED) {
+            j->procs[k].state = PROC_RUNNING;
+        }
+    }
+    j->reported = PROC_RUNNING;
+    signal_job(j, SIGCONT);
+}
+
+// Print "[N]+  State  command"; a finished job shows how it ended
+static void print_job(const struct job* j) {
+    char mark = j->id == current_job ? '+' : j->id == previous_job ? '-' : ' ';
+    int state = job_state(j);
+    int st = j->procs[j->count - 1].status;
+    char text[32] = "Done";
+    if (state != PROC_DONE) {
+        snprintf(text, sizeof(text), "%s", state == PROC_STOPPED ? "Stopped" : "Running");
+    } else if (WIFSIGNALED(st)) {
+        snprintf(text, sizeof(text), "%s", strsignal(WTERMSIG(st)));
+    } else if (WEXITSTATUS(st) != 0) {
+        snprintf(text, sizeof(text), "Exit %d", WEXITSTATUS(st));
+    }
+    printf("[%d]%c  %-8s %s\n", j->id, mark, text, j->command);
+}
+
+// Drop a finished job from the table
+static void drop_job(struct job* j) {
+    if (current_job == j->id) {
+        current_job = previous_job;
+        previous_job = 0;
+    } else if (previous_job == j->id) {
+        previous_job = 0;
+    }
+    free_job(j);
+}
+
+// Run a job in the foreground: hand it the terminal (continuing it if
+// resume is set) and wait. If it stops it goes to the job table and the
+// prompt comes back at once. Returns the status of its last process.
+static int foreground_job(struct job* j, int resume) {
+    int tty = job_control && j->pgid > 0;
+    if (tty) {
+        tcsetpgrp(tty_fd, j->pgid);
+        if (resume && j->has_tmodes) {
+            tcsetattr(tty_fd, TCSADRAIN, &j->tmodes);
+        }
+    }
+    if (resume) {
+        continue_job(j);
+    }
+    wait_job(j);
+    int stopped = job_state(j) == PROC_STOPPED;
+    if (tty) {
+        tcsetpgrp(tty_fd, shell_pgid);
+        if (stopped) {
+            j->has_tmodes = tcgetattr(tty_fd, &j->tmodes) == 0;
+        }
+        tcsetattr(tty_fd, TCSADRAIN, &shell_tmodes);
+    }
+    if (!stopped) {
+        for (int k = 0; k < j->count && job_control && !interrupted; k++) {
+            int st = j->procs[k].status;
+            if (WIFSIGNALED(st) && WTERMSIG(st) == SIGINT) {
+                interrupted = 1;
+                printf("\n");  // The prompt starts on a line of its own after ^C
+            }
+        }
+        return wait_status(j->procs[j->count - 1].status);
+    }
+    if (j->id == 0 && add_job(j) < 0) {
+        signal_job(j, SIGCONT);  // Nowhere to keep it: let it run on unwatched
+        free_job(j);
+        return 128 + SIGTSTP;
+    }
+    previous_job = current_job != j->id ? current_job : previous_job;
+    current_job = j->id;
+    j->reported = PROC_STOPPED;
+    printf("\n");
+    print_job(j);
+    fflush(stdout);
+    for (int k = 0; k < j->count; k++) {
+        if (j->procs[k].state == PROC_STOPPED) {
+            return wait_status(j->procs[k].status);
+        }
+    }
+    return 128 + SIGTSTP;
+}
+
+// Collect the status changes of jobs without blocking. With report set
+// (before a prompt) finished and newly stopped jobs are announced;
+// finished jobs are dropped then, or at once without job control.
+static void update_jobs(int report) {
+    int st;
+    struct rusage ru;
+    pid_t pid;
+    if (embedded) {
+        // No SIGCHLD handler in a host program, whose children are its own
+        for (int i = 0; i < MAX_JOBS; i++) {
+            for (int k = 0; jobs[i] != NULL && k < jobs[i]->count; k++) {
+                if (jobs[i]->procs[k].state != PROC_DONE &&
+                    (pid = wait4(jobs[i]->procs[k].pid, &st, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+                    record_status(pid, st, &ru, NULL);
+                }
+            }
+        }
+    } else if (children_changed) {
+        children_changed = 0;
+        while ((pid = wait4(-1, &st, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+            record_status(pid, st, &ru, NULL);
+        }
+    }
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job* j = jobs[i];
+        if (j == NULL) {
+            continue;
+        }
+        int state = job_state(j);
+        if (state == PROC_DONE && (report || !job_control)) {
+            if (report && job_control) {
+                print_job(j);
+            }
+            drop_job(j);
+        } else if (report && job_control && state != j->reported) {
+            j->reported = state;
+            print_job(j);
+        }
+    }
+    fflush(stdout);
+}
+
+// Find the job of a job spec: %N, %% or %+ (current), %- (previous) or
+// %prefix of its command. With numbers set a bare N is a job number too.
+static struct job* find_job(const char* spec, const char* who, int numbers) {
+    struct job* found = NULL;
+    const char* s = spec[0] == '%' ? spec + 1 : spec;
+    if (spec[0] != '%' && !numbers) {
+        found = NULL;
+    } else if (*s == '\0' || strcmp(s, "%") == 0 || strcmp(s, "+") == 0) {
+        found = current_job ? jobs[current_job - 1] : NULL;
+    } else if (strcmp(s, "-") == 0) {
+        found = previous_job ? jobs[previous_job - 1] : NULL;
+    } else if (isdigit((unsigned char)*s)) {
+        int id = atoi(s);
+        found = id >= 1 && id <= MAX_JOBS ? jobs[id - 1] : NULL;
+    } else {
+        for (int i = MAX_JOBS - 1; i >= 0 && found == NULL; i--) {
+            if (jobs[i] != NULL && strncmp(jobs[i]->command, s, strlen(s)) == 0) {
+                found = jobs[i];
+            }
+        }
+    }
+    if (found == NULL) {
+        fprintf(stderr, "%s: %s: no such job\n", who, spec);
+    }
+    return found;
+}
+
+// Output spooling. While $PUCITSH_SPOOL is set, a background job's output
+// and errors go into a pipe instead of the terminal, and a thread of the
+// shell copies whatever arrives into a ring of the newest $PUCITSH_SPOOL
+// KiB (default SPOOL_SIZE) for jobs -o to show. The ring is a memfd mapped
+// twice back to back, so the kept output and each read() into the ring are
+// one contiguous span however they wrap. The thread waits on all the
+// pipes with one epoll and does a single read() per ready pipe per round,
+// so no job is starved and none can block the shell, however many run.
+// A job's output stays until its job number is given to a new job.
+struct spool {
+    char* ring;        // size bytes, mapped a second time right after
+    size_t size;
+    uint64_t written;  // Bytes read from the pipe so far; the ring keeps the last size of them
+    int fd;            // Read end of the job's pipe, -1 once every writer closed it
+    uint32_t gen;      // Tells epoll events for this spool from those of an earlier one
+};
+
+struct spool* spools[MAX_JOBS];  // spools[i] is the output of %(i + 1)
+struct spool* spool_next;        // Spool of the background job being started
+int spool_out = -1;              // Write end of its pipe, for the job's processes
+int spool_epoll = -1;
+pid_t spool_pid;                 // Process running the spool thread
+uint32_t spool_gen;
+pthread_t spool_thread;
+pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards spools[] and the rings
+
+// Stop watching a spool's pipe and unmap its ring; spool_lock held
+static void free_spool(struct spool* s) {
+    if (s->fd >= 0) {
+        epoll_ctl(spool_epoll, EPOLL_CTL_DEL, s->fd, NULL);
+        close(s->fd);
+    }
+    munmap(s->ring, 2 * s->size);
+    mem_free(MEM_JOBS, s);
+}
+
+// One read() from the pipe into the ring; spool_lock held
+static void drain_spool(struct spool* s) {
+    ssize_t n = read(s->fd, s->ring + s->written % s->size, s->size);
+    if (n > 0) {
+        s->written += n;
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        epoll_ctl(spool_epoll, EPOLL_CTL_DEL, s->fd, NULL);
+        close(s->fd);
+        s->fd = -1;
+    }
+}
+
+static void* run_spool_thread(void* arg) {
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    struct epoll_event events[64];
+    for (;;) {
+        int n = epoll_wait(spool_epoll, events, 64, -1);
+        pthread_mutex_lock(&spool_lock);
+        for (int i = 0; i < n; i++) {
+            // The job number and generation of the spool, which may be gone
+            struct spool* s = spools[events[i].data.u64 >> 32];
+            if (s != NULL && s->gen == (uint32_t)events[i].data.u64 && s->fd >= 0) {
+                drain_spool(s);
+            }
+        }
+        pthread_mutex_unlock(&spool_lock);
+    }
+    return NULL;
+}
+
+// Before forking a background job: a spool and its pipe if $PUCITSH_SPOOL
+// is set. Child shells leave spooling to the shell that runs the thread.
+static void new_spool(void) {
+    const char* kib = get_var("PUCITSH_SPOOL");
+    if (kib == NULL || (spool_epoll >= 0 && getpid() != spool_pid)) {
+        return;
+    }
+    if (spool_epoll < 0) {
+        spool_epoll = move_fd_high(epoll_create1(EPOLL_CLOEXEC));
+        spool_pid = getpid();
+        if (spool_epoll < 0 || pthread_create(&spool_thread, NULL, run_spool_thread, NULL) != 0) {
+            perror("spool");
+            return;
+        }
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = atol(kib) > 0 ? (size_t)atol(kib) * 1024 : SPOOL_SIZE;
+    size = (size + page - 1) / page * page;
+
+    int pipefd[2];
+    int mfd = memfd_create("spool", MFD_CLOEXEC);
+    char* ring = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mfd < 0 || ring == MAP_FAILED || ftruncate(mfd, size) < 0 ||
+        mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, mfd, 0) == MAP_FAILED ||
+        mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, mfd, 0) == MAP_FAILED ||
+        pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("spool");
+        if (mfd >= 0) {
+            close(mfd);
+        }
+        if (ring != MAP_FAILED) {
+            munmap(ring, 2 * size);
+        }
+        return;
+    }
+    close(mfd);  // The mappings keep it
+    fcntl(pipefd[1], F_SETFL, 0);  // The job's end blocks when the pipe is full, like a terminal
+    spool_next = mem_calloc(MEM_JOBS, 1, sizeof(struct spool));
+    spool_next->ring = ring;
+    spool_next->size = size;
+    spool_next->fd = move_fd_high(pipefd[0]);
+    spool_next->gen = ++spool_gen;
+    spool_out = move_fd_high(pipefd[1]);
+}
+
+// In a forked process of a spooled background job: output and errors go
+// to the spool, before the job's own pipes and redirections apply
+static void enter_spool(void) {
+    if (spool_out >= 0) {
+        dup2(spool_out, STDOUT_FILENO);
+        dup2(spool_out, STDERR_FILENO);
+        close(spool_out);
+        spool_out = -1;
+    }
+}
+
+// After the background job started: drop the shell's copy of the write end
+static void end_spool(void) {
+    if (spool_out >= 0) {
+        close(spool_out);
+        spool_out = -1;
+    }
+    if (spool_next != NULL) {
+        close(spool_next->fd);  // The job never made it into the table
+        munmap(spool_next->ring, 2 * spool_next->size);
+        mem_free(MEM_JOBS, spool_next);
+        spool_next = NULL;
+    }
+}
+
+// Job number id was just given to a job: it gets the pending spool, if
+// any, and the output of the job that had the number before is freed
+static void attach_spool(int id) {
+    pthread_mutex_lock(&spool_lock);
+    if (spools[id - 1] != NULL) {
+        free_spool(spools[id - 1]);
+    }
+    spools[id - 1] = spool_next;
+    pthread_mutex_unlock(&spool_lock);
+    if (spool_next != NULL) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.u64 = (uint64_t)(id - 1) << 32 | spool_next->gen};
+        epoll_ctl(spool_epoll, EPOLL_CTL_ADD, spool_next->fd, &ev);
+        spool_next = NULL;
+    }
+}
+
+// jobs -o [%job] [-n lines] [-w file]: print the kept output of a job, or
+// its last lines, or save it to a file. %N also finds a finished job.
+static int show_spool(char** argv, struct builtin_io* io) {
+    const char* spec = "%%";
+    const char* save = NULL;
+    long lines = -1;
+    for (int i = 2; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-n") == 0 && argv[i + 1] != NULL) {
+            lines = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && argv[i + 1] != NULL) {
+            save = argv[++i];
+        } else {
+            spec = argv[i];
+        }
+    }
+    const char* s = spec[0] == '%' ? spec + 1 : spec;
+    int id = 0;
+    if (isdigit((unsigned char)*s)) {
+        id = atoi(s);
+    } else {
+        struct job* j = find_job(spec, "jobs", 1);
+        id = j ? j->id : 0;
+    }
+    if (id < 1 || id > MAX_JOBS) {
+        return 1;
+    }
+
+    // Copy the kept output out under the lock; the terminal or file may be slow
+    pthread_mutex_lock(&spool_lock);
+    struct spool* sp = spools[id - 1];
+    size_t len = 0;
+    uint64_t written = 0;
+    char* text = NULL;
+    if (sp != NULL) {
+        written = sp->written;
+        len = written < sp->size ? written : sp->size;
+        text = mem_malloc(MEM_JOBS, len + 1);
+        memcpy(text, sp->ring + (written - len) % sp->size, len);
+    }
+    pthread_mutex_unlock(&spool_lock);
+    if (sp == NULL) {
+        dprintf(io->err, "jobs: %%%d: no spooled output\n", id);
+        return 1;
+    }
+
+    char* start = text;
+    if (written > len) {
+        // The ring wrapped: start at the first whole line
+        char* nl = memchr(text, '\n', len);
+        start = nl ? nl + 1 : text;
+    }
+    if (written > len && lines < 0) {
+        dprintf(io->err, "jobs: %%%d: only the last %zu of %llu bytes are kept\n", id, len - (start - text),
+                (unsigned long long)written);
+    }
+    char* end = text + len;
+    if (lines >= 0) {
+        char* p = end;
+        if (p > start && p[-1] == '\n') {
+            p--;
+        }
+        for (long n = 0; p > start; p--) {
+            if (p[-1] == '\n' && ++n == lines) {
+                break;
+            }
+        }
+        start = p;
+    }
+    int status = 0;
+    int fd = save ? open(save, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) : io->out;
+    if (fd < 0 || write_all(fd, start, end - start) < 0) {
+        dprintf(io->err, "jobs: %s: %s\n", save ? save : "write", strerror(errno));
+        status = 1;
+    }
+    if (save && fd >= 0) {
+        close(fd);
+    }
+    mem_free(MEM_JOBS, text);
+    return status;
+}
+
+static int builtin_jobs(char** argv, struct builtin_io* io) {
+    if (argv[1] != NULL && strcmp(argv[1], "-o") == 0) {
+        return show_spool(argv, io);
+    }
+    int pids = argv[1] != NULL && strcmp(argv[1], "-l") == 0;
+    update_jobs(0);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct job* j = jobs[i];
+        if (j == NULL) {
+            continue;
+        }
+        print_job(j);
+        for (int k = 0; pids && k < j->count; k++) {
+            static const char* names[] = {"running", "stopped", "done"};
+            printf("      %d %s\n", j->procs[k].pid, names[j->procs[k].state]);
+        }
+        j->reported = job_state(j);
+        if (j->reported == PROC_DONE) {
+            drop_job(j);  // Finished jobs are listed once
+        }
+    }
+    return 0;
+}
+
+// fg [%job]: continue a job in the foreground and wait for it
+static int builtin_fg(char** argv, struct builtin_io* io) {
+    update_jobs(0);
+    struct job* j = find_job(argv[1] ? argv[1] : "%%", "fg", 1);
+    if (j == NULL) {
+        return 1;
+    }
+    printf("%s\n", j->command);
+    fflush(stdout);
+    int status = foreground_job(j, 1);
+    if (job_state(j) == PROC_DONE) {
+        drop_job(j);
+    }
+    return status;
+}
+
+// bg [%job]: continue a stopped job in the background
+static int builtin_bg(char** argv, struct builtin_io* io) {
+    update_jobs(0);
+    struct job* j = find_job(argv[1] ? argv[1] : "%%", "bg", 1);
+    if (j == NULL) {
+        return 1;
+    }
+    continue_job(j);
+    printf("[%d] %s &\n", j->id, j->command);
+    return 0;
+}
+
+// Signal number of a name such as TERM, SIGTERM or 15; -1 if unknown
+static int signal_number(const char* name) {
+    static const struct {
+        const char* name;
+        int sig;
+    } signals[] = {
+        {"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"TERM", SIGTERM},
+        {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"PIPE", SIGPIPE}, {"CHLD", SIGCHLD},
+        {"STOP", SIGSTOP}, {"CONT", SIGCONT}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+        {NULL, 0},
+    };
+    if (isdigit((unsigned char)name[0])) {
+        return atoi(name);
+    }
+    if (strncasecmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (int i = 0; signals[i].name != NULL; i++) {
+        if (strcasecmp(name, signals[i].name) == 0) {
+            return signals[i].sig;
+        }
+    }
+    return -1;
+}
+
+// kill [-SIG | -s SIG] pid|%job...: a job is signalled as a whole with one
+// killpg(). Without a signal it is SIGKILL, as in earlier versions.
+static int builtin_kill(char** argv, struct builtin_io* io) {
+    int sig = SIGKILL, i = 1;
+    if (argv[1] != NULL && argv[1][0] == '-' && argv[1][1] != '\0') {
+        const char* name = argv[1] + 1;
+        i = 2;
+        if (strcmp(argv[1], "-s") == 0) {
+            name = argv[2];
+            i = name ? 3 : 2;
+        }
+        if (name == NULL || (sig = signal_number(name)) < 0) {
+            fprintf(stderr, "kill: %s: invalid signal\n", name ? name : "-s");
+            return 1;
+        }
+    }
+    if (argv[i] == NULL) {
+        fprintf(stderr, "kill: missing argument\n");
+        return 1;
+    }
+    int status = 0;
+    for (; argv[i] != NULL; i++) {
+        if (argv[i][0] == '%') {
+            update_jobs(0);
+            struct job* j = find_job(argv[i], "kill", 0);
+            if (j == NULL || signal_job(j, sig) < 0) {
+                status = 1;
+                if (j != NULL) {
+                    perror("kill failed");
+                }
+                continue;
+            }
+            // A stopped job only acts on a terminating signal once continued
+            if (job_state(j) == PROC_STOPPED && (sig == SIGTERM || sig == SIGHUP || sig == SIGINT)) {
+                continue_job(j);
+            }
+        } else if (kill(atoi(argv[i]), sig) == -1) {
+            perror("kill failed");
+            status = 1;
+        }
+    }
+    return status;
+}
+
+static int builtin_export(char** argv, struct builtin_io* io) {
+    for (int i = 1; argv[i] != NULL; i++) {
+        char* eq = strchr(argv[i], '=');
+        if (eq != NULL) {
+            *eq = '\0';
+        }
+        const char* value = eq ? eq + 1 : get_var(argv[i]);
+        setenv(argv[i], value ? value : "", 1);
+        set_var(argv[i], value ? value : "");
+        if (eq != NULL) {
+            *eq = '=';
+        }
+    }
+    return 0;
+}
+
+static int builtin_unset(char** argv, struct builtin_io* io) {
+    for (int i = 1; argv[i] != NULL; i++) {
+        unset_var(argv[i]);
+    }
+    return 0;
+}
+
+static int builtin_shift(char** argv, struct builtin_io* io) {
+    int n = argv[1] ? atoi(argv[1]) : 1;
+    if (n < 0 || n > positional_count) {
+        return 1;
+    }
+    positional += n;
+    positional_count -= n;
+    return 0;
+}
+
+// break and continue take the number of enclosing loops to act on
+static int loop_count(char** argv) {
+    int n = argv[1] ? atoi(argv[1]) : 1;
+    if (n < 1) {
+        n = 1;
+    }
+    return n > loop_depth ? loop_depth : n;
+}
+
+static int builtin_break(char** argv, struct builtin_io* io) {
+    break_levels = loop_count(argv);
+    return 0;
+}
+
+static int builtin_continue(char** argv, struct builtin_io* io) {
+    continue_levels = loop_count(argv);
+    return 0;
+}
+
+static int builtin_return(char** argv, struct builtin_io* io) {
+    return_status = argv[1] ? atoi(argv[1]) : last_status;
+    returning = 1;
+    return return_status;
+}
+
+// Write all of buf, retrying short writes
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write the text a builtin collected in a memory stream to its output with
+// one write(), so builtins never go through the shell's stdout buffer
+static int flush_output(FILE* f, char** text, size_t* len, int fd) {
+    fclose(f);
+    int status = write_all(fd, *text, *len) < 0 ? 1 : 0;
+    free(*text);
+    return status;
+}
+
+// Print an alias as "alias name='value'", which defines it again when run
+static void print_alias(FILE* f, const struct alias* a) {
+    fprintf(f, "alias %s='", a->name);
+    for (const char* p = a->value; *p; p++) {
+        if (*p == '\'') {
+            fputs("'\"'\"'", f);  // No backslash escapes here: close, "'", reopen
+        } else {
+            fputc(*p, f);
+        }
+    }
+    fputs("'\n", f);
+}
+
+static int compare_aliases(const void* a, const void* b) {
+    return strcmp((*(struct alias* const*)a)->name, (*(struct alias* const*)b)->name);
+}
+
+// alias [name[=value]...]: define aliases, or print the named ones or all
+static int builtin_alias(char** argv, struct builtin_io* io) {
+    char* text;
+    size_t len;
+    FILE* f = open_memstream(&text, &len);
+    int status = 0;
+    if (argv[1] == NULL) {
+        struct alias** sorted = mem_malloc(MEM_OTHER, (alias_count + 1) * sizeof(struct alias*));
+        size_t n = 0;
+        for (size_t i = 0; i < alias_cap; i++) {
+            if (alias_table[i].name != NULL && alias_table[i].name != alias_removed) {
+                sorted[n++] = &alias_table[i];
+            }
+        }
+        qsort(sorted, n, sizeof(struct alias*), compare_aliases);
+        for (size_t i = 0; i < n; i++) {
+            print_alias(f, sorted[i]);
+        }
+        mem_free(MEM_OTHER, sorted);
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        char* eq = strchr(argv[i], '=');
+        if (eq == NULL) {
+            struct alias* a = find_alias(argv[i]);
+            if (a != NULL) {
+                print_alias(f, a);
+            } else {
+                dprintf(io->err, "alias: %s: not found\n", argv[i]);
+                status = 1;
+            }
+            continue;
+        }
+        *eq = '\0';
+        if (argv[i][0] == '\0' || argv[i][strcspn(argv[i], " \t'\"\\$`/;&|()<>")] != '\0') {
+            dprintf(io->err, "alias: %s: invalid alias name\n", argv[i]);
+            status = 1;
+        } else {
+            set_alias(argv[i], eq + 1);
+        }
+        *eq = '=';
+    }
+    int written = flush_output(f, &text, &len, io->out);
+    return status ? status : written;
+}
+
+// unalias [-a] name...: remove aliases, -a all of them
+static int builtin_unalias(char** argv, struct builtin_io* io) {
+    if (argv[1] != NULL && strcmp(argv[1], "-a") == 0) {
+        for (size_t i = 0; i < alias_cap; i++) {
+            if (alias_table[i].name != NULL && alias_table[i].name != alias_removed) {
+                remove_alias(alias_table[i].name);
+            }
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (remove_alias(argv[i]) < 0) {
+            dprintf(io->err, "unalias: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Audit log. While $PUCITSH_AUDIT names a file, every command the shell
+// reads at the top level is logged with its start time, uid, directory,
+// duration and exit status. The shell only copies a fixed-size record into
+// a single-producer single-consumer ring; a writer thread formats whatever
+// has piled up, appends it with one write() and fdatasync()s at most every
+// AUDIT_SYNC_MS. The prompt never waits for the disk: when the ring is full
+// the record is dropped and counted, and the writer logs the count.
+struct audit_record {
+    struct timespec when;  // Start, CLOCK_REALTIME
+    double seconds;
+    uid_t uid;
+    int status;
+    char cwd[AUDIT_TEXT];
+    char command[AUDIT_TEXT];
+};
+
+struct audit_log {
+    struct audit_record ring[AUDIT_RING];
+    size_t head;       // Records added; only the shell stores it
+    size_t tail;       // Records taken; only the writer stores it
+    long dropped;
+    long written;
+    int fd;            // The log, opened for appending
+    int wake;          // eventfd the shell signals after adding a record
+    int stop;
+    pid_t pid;         // Process running the writer; forked children have none
+    char* path;        // Set at the first command logged, NULL until then
+    pthread_t thread;
+};
+
+struct audit_log audit = {.fd = -1};
+
+// Text of a top-level command: its list items, as node_text() shows them
+static void command_text(struct node* n, char* buf, size_t size) {
+    buf[0] = '\0';
+    if (n->type != NODE_LIST) {
+        node_text(n, buf, size);
+        return;
+    }
+    for (int i = 0; i < n->kid_count && strlen(buf) < size - 1; i++) {
+        int last = i == n->kid_count - 1;
+        node_text(n->kids[i], buf, size);
+        snprintf(buf + strlen(buf), size - strlen(buf), "%s",
+                 (n->kids[i]->flags & NODE_BACKGROUND) ? (last ? " &" : " & ") : (last ? "" : "; "));
+    }
+}
+
+// Append one log line for r to buf
+static size_t format_audit(const struct audit_record* r, char* buf, size_t size) {
+    struct tm tm;
+    gmtime_r(&r->when.tv_sec, &tm);
+    size_t len = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    len += snprintf(buf + len, size - len, ".%03ldZ\tuid=%u\tstatus=%d\tduration=%.3f\tcwd=%s\tcmd=%s\n",
+                    r->when.tv_nsec / 1000000, (unsigned)r->uid, r->status, r->seconds, r->cwd, r->command);
+    return len < size ? len : size - 1;
+}
+
+// Writer thread: sleeps on the eventfd, drains the ring in one batch per
+// wakeup and syncs once AUDIT_SYNC_MS have passed since the last sync
+static void* run_audit_writer(void* arg) {
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    size_t line_max = 2 * AUDIT_TEXT + 128;
+    char* buf = mem_malloc(MEM_OTHER, (AUDIT_RING + 1) * line_max);
+    long reported = 0;
+    int dirty = 0, stopping = 0;
+    struct timespec synced;
+    clock_gettime(CLOCK_MONOTONIC, &synced);
+    while (!stopping) {
+        struct pollfd p = {audit.wake, POLLIN, 0};
+        poll(&p, 1, dirty ? AUDIT_SYNC_MS : -1);
+        uint64_t count;
+        if (read(audit.wake, &count, sizeof(count)) < 0) {
+            // Woken by the timeout: nothing new, only the sync is due
+        }
+        stopping = __atomic_load_n(&audit.stop, __ATOMIC_ACQUIRE);
+
+        size_t len = 0, tail = audit.tail;
+        size_t head = __atomic_load_n(&audit.head, __ATOMIC_ACQUIRE);
+        long records = head - tail;
+        for (; tail != head; tail++) {
+            len += format_audit(&audit.ring[tail % AUDIT_RING], buf + len, line_max);
+        }
+        __atomic_store_n(&audit.tail, tail, __ATOMIC_RELEASE);  // The slots are free again
+        long dropped = __atomic_load_n(&audit.dropped, __ATOMIC_RELAXED);
+        if (dropped != reported) {
+            len += snprintf(buf + len, line_max, "# ring full: %ld records dropped, %ld in all\n",
+                            dropped - reported, dropped);
+            reported = dropped;
+        }
+        if (len > 0 && write_all(audit.fd, buf, len) == 0) {
+            __atomic_add_fetch(&audit.written, records, __ATOMIC_RELAXED);
+            dirty = 1;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (now.tv_sec - synced.tv_sec) * 1000 + (now.tv_nsec - synced.tv_nsec) / 1000000;
+        if (dirty && (ms >= AUDIT_SYNC_MS || stopping)) {
+            fdatasync(audit.fd);
+            synced = now;
+            dirty = 0;
+        }
+    }
+    mem_free(MEM_OTHER, buf);
+    return NULL;
+}
+
+// At exit: let the writer drain the ring and sync, then wait for it
+static void stop_audit(void) {
+    if (audit.fd < 0 || getpid() != audit.pid) {
+        return;
+    }
+    __atomic_store_n(&audit.stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(audit.wake, &one, sizeof(one)) < 0) {
+        // The counter is already nonzero, so the writer wakes anyway
+    }
+    pthread_join(audit.thread, NULL);
+}
+
+// Open the log and start the writer. The path is kept even when this
+// fails, so the error is reported once.
+static void start_audit(const char* path) {
+    audit.path = mem_strdup(MEM_OTHER, path);
+    int fd = move_fd_high(open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    audit.wake = move_fd_high(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    audit.pid = getpid();
+    if (audit.wake < 0 || pthread_create(&audit.thread, NULL, run_audit_writer, NULL) != 0) {
+        perror("audit");
+        close(fd);
+        if (audit.wake >= 0) {
+            close(audit.wake);
+        }
+        return;
+    }
+    audit.fd = fd;
+    atexit(stop_audit);
+}
+
+// $PUCITSH_AUDIT names a log for the shell's own commands
+static int audit_wanted(void) {
+    const char* path = get_var("PUCITSH_AUDIT");
+    return path != NULL && path[0] != '\0';
+}
+
+// Run a command the shell read at the top level and log it while
+// $PUCITSH_AUDIT is set
+static int audit_run(struct node* n) {
+    if (!audit_wanted()) {
+        return run_node(n);
+    }
+    if (audit.path == NULL) {
+        start_audit(get_var("PUCITSH_AUDIT"));
+    }
+    char cwd[AUDIT_TEXT];  // Where it started, before any cd in it
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        snprintf(cwd, sizeof(cwd), "?");
+    }
+    struct timespec when, start, end;
+    clock_gettime(CLOCK_REALTIME, &when);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = run_node(n);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (audit.fd < 0) {
+        return status;
+    }
+
+    size_t head = audit.head;
+    size_t queued = head - __atomic_load_n(&audit.tail, __ATOMIC_ACQUIRE);
+    if (queued >= AUDIT_RING * 3 / 4) {
+        // Falling behind, as on one CPU where the writer only runs when the
+        // shell sleeps: offer it the CPU once, without waiting for it
+        sched_yield();
+        queued = head - __atomic_load_n(&audit.tail, __ATOMIC_ACQUIRE);
+    }
+    if (queued == AUDIT_RING) {
+        __atomic_add_fetch(&audit.dropped, 1, __ATOMIC_RELAXED);
+        return status;
+    }
+    struct audit_record* r = &audit.ring[head % AUDIT_RING];
+    r->when = when;
+    r->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    r->uid = getuid();
+    r->status = status;
+    memcpy(r->cwd, cwd, sizeof(cwd));
+    command_text(n, r->command, sizeof(r->command));
+    __atomic_store_n(&audit.head, head + 1, __ATOMIC_RELEASE);  // Publish the record
+    uint64_t one = 1;
+    if (write(audit.wake, &one, sizeof(one)) < 0) {
+        // EAGAIN: the counter is saturated, the writer is awake regardless
+    }
+    return status;
+}
+
+// audit: where the log goes and how many records were written or dropped
+static int builtin_audit(char** argv, struct builtin_io* io) {
+    if (audit.fd < 0) {
+        dprintf(io->out, "audit: %s\n", audit.path ? "could not open the log" : "off; set PUCITSH_AUDIT to a file");
+        return audit.path ? 1 : 0;
+    }
+    dprintf(io->out, "audit: %s: %ld records written, %ld dropped, %zu queued\n", audit.path,
+            __atomic_load_n(&audit.written, __ATOMIC_RELAXED), __atomic_load_n(&audit.dropped, __ATOMIC_RELAXED),
+            audit.head - __atomic_load_n(&audit.tail, __ATOMIC_ACQUIRE));
+    return 0;
+}
+
+// Path of a command or sourced file as execvp() would find it: name itself
+// if it has a slash, else the first $PATH directory holding a regular file
+// accessible with mode. Returns -1 if there is none.
+static int find_command(const char* name, char* path, size_t size, int mode) {
+    struct stat st;
+    if (strchr(name, '/') != NULL) {
+        snprintf(path, size, "%s", name);
+        return access(path, mode) == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode) ? 0 : -1;
+    }
+    const char* p = get_var("PATH");
+    for (p = p ? p : "";; p++) {
+        size_t len = strcspn(p, ":");
+        snprintf(path, size, "%.*s%s%s", (int)len, p, len ? "/" : "", name);  // An empty entry is "."
+        if (access(path, mode) == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            return 0;
+        }
+        p += len;
+        if (*p == '\0') {
+            return -1;
+        }
+    }
+}
+
+// source file [args] and . file [args]: run the file's commands in this
+// shell, with args as $1... while it runs. return leaves the file.
+static int builtin_source(char** argv, struct builtin_io* io) {
+    if (argv[1] == NULL) {
+        dprintf(io->err, "usage: %s file [arg...]\n", argv[0]);
+        return 2;
+    }
+    char path[MAX_LEN];
+    if (find_command(argv[1], path, sizeof(path), R_OK) < 0) {
+        snprintf(path, sizeof(path), "%s", argv[1]);  // Not in $PATH: the current directory
+    }
+    struct input in = {0};
+    in.fd = move_fd_high(open(path, O_RDONLY | O_CLOEXEC));
+    in.sourced = 1;
+    if (in.fd < 0) {
+        dprintf(io->err, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+        return 1;
+    }
+    char** saved = positional;
+    int saved_count = positional_count;
+    if (argv[2] != NULL) {
+        positional = argv + 2;
+        for (positional_count = 0; positional[positional_count] != NULL; positional_count++) {
+        }
+    }
+    int status = run_input(&in);
+    positional = saved;
+    positional_count = saved_count;
+    close(in.fd);
+    mem_free(MEM_PARSE, in.buf);
+    return status;
+}
+
+// In a forked child about to run a script of this shell: drop what a
+// newly started shell would not have. Exported variables stay in the
+// environment, which get_var() falls back to.
+static void forget_shell_state(void) {
+    memset(var_table, 0, sizeof(var_table));
+    functions = NULL;
+    alias_table = NULL;
+    alias_cap = alias_count = alias_used = 0;
+    pending_outputs = NULL;  // The parent publishes its own >! files
+    audit.fd = -1;           // Its writer thread stayed in the parent
+    audit.path = NULL;
+    audit.head = audit.tail = 0;
+    audit.dropped = audit.written = 0;
+    memset(spools, 0, sizeof(spools));
+    spool_next = NULL;
+    spool_epoll = -1;
+    pthread_mutex_init(&spool_lock, NULL);
+    last_status = loop_depth = 0;
+}
+
+// Run argv as a script in this forked child if its #! line names this
+// shell's executable, as if it had been exec'd: the parsed-once
+// builtins, caches and loaded binary are reused. Returns if it is not
+// such a script, and the caller execs it.
+static void run_own_script(char** argv) {
+    char path[MAX_LEN], line[MAX_LEN];
+    if (find_command(argv[0], path, sizeof(path), X_OK) < 0) {
+        return;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? pread(fd, line, sizeof(line) - 1, 0) : -1;
+    if (n < 2 || strncmp(line, "#!", 2) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;  // A binary, or a file we may only execute
+    }
+    line[n] = '\0';
+    char* interp = line + 2;
+    while (*interp == ' ' || *interp == '\t') {
+        interp++;
+    }
+    size_t len = strcspn(interp, " \t\n");
+    char* rest = interp + len + strspn(interp + len, " \t");
+    static char self[PATH_MAX];
+    char real[PATH_MAX];
+    if (self[0] == '\0' && realpath("/proc/self/exe", self) == NULL) {
+        self[0] = '\0';
+    }
+    interp[len] = '\0';
+    // Options after the interpreter are left to a real exec
+    if ((*rest != '\n' && *rest != '\0') || realpath(interp, real) == NULL || strcmp(real, self) != 0) {
+        close(fd);
+        return;
+    }
+    forget_shell_state();
+    struct input in = {0};
+    in.fd = move_fd_high(fd);
+    in.audited = 1;
+    in.exec_last = 1;
+    shell_name = path;
+    positional = argv + 1;
+    for (positional_count = 0; positional[positional_count] != NULL; positional_count++) {
+    }
+    exit_child(run_input(&in));
+}
+
+// Print the backslash escape at p (\n, \t, \\, \0NNN, ...) and return its
+// last character. Returns NULL for \c, which ends the output.
+static const char* put_escape(FILE* f, const char* p) {
+    static const char from[] = "abefnrtv\\";
+    static const char to[] = "\a\b\033\f\n\r\t\v\\";
+    const char* hit = p[1] ? strchr(from, p[1]) : NULL;
+    if (hit != NULL) {
+        fputc(to[hit - from], f);
+        return p + 1;
+    }
+    if (p[1] == 'c') {
+        return NULL;
+    }
+    if (p[1] == '0') {
+        int value = 0, n = 0;
+        for (p += 2; n < 3 && *p >= '0' && *p <= '7'; n++, p++) {
+            value = value * 8 + (*p - '0');
+        }
+        fputc(value, f);
+        return p - 1;
+    }
+    fputc('\\', f);
+    return p;
+}
+
+// Print text, interpreting backslash escapes when escapes is set.
+// Returns 0 if \c ended the output.
+static int put_text(FILE* f, const char* text, int escapes) {
+    for (const char* p = text; *p; p++) {
+        if (escapes && *p == '\\') {
+            if ((p = put_escape(f, p)) == NULL) {
+                return 0;
+            }
+        } else {
+            fputc(*p, f);
+        }
+    }
+    return 1;
+}
+
+static int builtin_echo(char** argv, struct builtin_io* io) {
+    int newline = 1, escapes = 0, i = 1;
+    // Options: -n drops the newline, -e interprets escapes, -E does not
+    while (argv[i] && argv[i][0] == '-' && argv[i][1] && strspn(argv[i] + 1, "neE") == strlen(argv[i] + 1)) {
+        for (const char* o = argv[i++] + 1; *o; o++) {
+            if (*o == 'n') {
+                newline = 0;
+            } else {
+                escapes = *o == 'e';
+            }
+        }
+    }
+    char* text;
+    size_t len;
+    FILE* f = open_memstream(&text, &len);
+    for (int first = i; argv[i] != NULL; i++) {
+        if (i > first) {
+            fputc(' ', f);
+        }
+        if (!put_text(f, argv[i], escapes)) {
+            return flush_output(f, &text, &len, io->out);
+        }
+    }
+    if (newline) {
+        fputc('\n', f);
+    }
+    return flush_output(f, &text, &len, io->out);
+}
+
+// printf FORMAT [ARG...]: %s %b %c %d %i %u %o %x %X with flags, width and
+// precision. The format is reused while arguments are left.
+static int builtin_printf(char** argv, struct builtin_io* io) {
+    if (argv[1] == NULL) {
+        dprintf(io->err, "printf: missing format\n");
+        return 2;
+    }
+    char* text;
+    size_t len;
+    FILE* f = open_memstream(&text, &len);
+    char** args = argv + 2;
+    char** before;
+    do {
+        before = args;
+        for (const char* p = argv[1]; *p; p++) {
+            if (*p == '\\') {
+                if ((p = put_escape(f, p)) == NULL) {
+                    return flush_output(f, &text, &len, io->out);
+                }
+                continue;
+            }
+            if (*p != '%' || p[1] == '%' || p[1] == '\0') {
+                fputc(*p, f);
+                p += *p == '%' && p[1] == '%';
+                continue;
+            }
+            char spec[32];
+            int n = 0;
+            spec[n++] = *p++;
+            while (*p && strchr("-+ #0123456789.", *p) && n < 28) {
+                spec[n++] = *p++;
+            }
+            const char* arg = *args ? *args++ : NULL;
+            switch (*p) {
+            case 'd':
+            case 'i':
+                spec[n++] = 'l';
+                spec[n++] = *p;
+                spec[n] = '\0';
+                fprintf(f, spec, arg ? strtol(arg, NULL, 0) : 0L);
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                spec[n++] = 'l';
+                spec[n++] = *p;
+                spec[n] = '\0';
+                fprintf(f, spec, arg ? strtoul(arg, NULL, 0) : 0UL);
+                break;
+            case 'c':
+                spec[n++] = 'c';
+                spec[n] = '\0';
+                fprintf(f, spec, arg ? arg[0] : '\0');
+                break;
+            case 's':
+                spec[n++] = 's';
+                spec[n] = '\0';
+                fprintf(f, spec, arg ? arg : "");
+                break;
+            case 'b':
+                if (arg != NULL && !put_text(f, arg, 1)) {
+                    return flush_output(f, &text, &len, io->out);
+                }
+                break;
+            default:
+                spec[n] = '\0';
+                dprintf(io->err, "printf: %s%c: invalid conversion\n", spec, *p);
+                fclose(f);
+                free(text);
+                return 1;
+            }
+        }
+    } while (*args != NULL && args != before);
+    return flush_output(f, &text, &len, io->out);
+}
+
+// Unary test operators; -1 if op is not one
+static int test_unary(const char* op, const char* arg) {
+    struct stat st;
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+        return -1;
+    }
+    switch (op[1]) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 'e': return stat(arg, &st) == 0;
+    case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+    case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+    case 's': return stat(arg, &st) == 0 && st.st_size > 0;
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    }
+    return -1;
+}
+
+// Binary test operators; -1 if op is not one
+static int test_binary(const char* a, const char* op, const char* b) {
+    static const char* ints[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL};
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(a, b) == 0;
+    }
+    if (strcmp(op, "!=") == 0) {
+        return strcmp(a, b) != 0;
+    }
+    if (strcmp(op, "<") == 0 || strcmp(op, ">") == 0) {
+        return op[0] == '<' ? strcmp(a, b) < 0 : strcmp(a, b) > 0;
+    }
+    for (int i = 0; ints[i] != NULL; i++) {
+        if (strcmp(op, ints[i]) == 0) {
+            long x = strtol(a, NULL, 10), y = strtol(b, NULL, 10);
+            long results[] = {x == y, x != y, x < y, x <= y, x > y, x >= y};
+            return results[i];
+        }
+    }
+    return -1;
+}
+
+// Evaluate n test arguments: 1 true, 0 false, -1 syntax error
+static int test_eval(char** args, int n) {
+    if (n == 0) {
+        return 0;
+    }
+    if (n == 1) {
+        return args[0][0] != '\0';
+    }
+    if (n == 2) {
+        return strcmp(args[0], "!") == 0 ? !test_eval(args + 1, 1) : test_unary(args[0], args[1]);
+    }
+    if (n == 3) {
+        int r = test_binary(args[0], args[1], args[2]);
+        if (r >= 0) {
+            return r;
+        }
+    }
+    // -o binds looser than -a, and both looser than !
+    for (int pass = 0; pass < 2; pass++) {
+        const char* op = pass == 0 ? "-o" : "-a";
+        for (int i = 1; i < n - 1; i++) {
+            if (strcmp(args[i], op) == 0) {
+                int l = test_eval(args, i), r = test_eval(args + i + 1, n - i - 1);
+                if (l < 0 || r < 0) {
+                    return -1;
+                }
+                return pass == 0 ? l || r : l && r;
+            }
+        }
+    }
+    if (strcmp(args[0], "!") == 0) {
+        int r = test_eval(args + 1, n - 1);
+        return r < 0 ? r : !r;
+    }
+    if (n == 3 && strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) {
+        return test_eval(args + 1, 1);
+    }
+    return -1;
+}
+
+// test EXPR and [ EXPR ]
+static int builtin_test(char** argv, struct builtin_io* io) {
+    int n = 0;
+    while (argv[n + 1] != NULL) {
+        n++;
+    }
+    if (strcmp(argv[0], "[") == 0) {
+        if (n == 0 || strcmp(argv[n], "]") != 0) {
+            dprintf(io->err, "[: missing ]\n");
+            return 2;
+        }
+        n--;
+    }
+    int r = test_eval(argv + 1, n);
+    if (r < 0) {
+        dprintf(io->err, "%s: syntax error\n", argv[0]);
+        return 2;
+    }
+    return !r;
+}
+
+static int builtin_true(char** argv, struct builtin_io* io) {
+    return 0;
+}
+
+static int builtin_false(char** argv, struct builtin_io* io) {
+    return 1;
+}
+
+static int builtin_pwd(char** argv, struct builtin_io* io) {
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        dprintf(io->err, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    dprintf(io->out, "%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+// read [-r] [-p prompt] [name...]: read one line and split it into the
+// variables at $IFS, the last one taking the rest. Input is read a byte at
+// a time so whatever follows the line is left for the next command.
+static int builtin_read(char** argv, struct builtin_io* io) {
+    int raw = 0, i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            raw = 1;
+        } else if (strcmp(argv[i], "-p") == 0 && argv[i + 1] != NULL) {
+            i++;
+            write_all(io->err, argv[i], strlen(argv[i]));
+        } else {
+            break;
+        }
+    }
+
+    size_t cap = MAX_LEN, len = 0;
+    char* line = mem_malloc(MEM_OTHER, cap);
+    char c = 0;
+    ssize_t r;
+    while ((r = read(io->in, &c, 1)) != 0) {
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (c == '\n') {
+            break;
+        }
+        if (c == '\\' && !raw) {
+            // Backslash quotes the next character; backslash-newline joins lines
+            if ((r = read(io->in, &c, 1)) <= 0) {
+                break;
+            }
+            if (c == '\n') {
+                continue;
+            }
+        }
+        if (len + 2 > cap) {
+            cap *= 2;
+            line = mem_realloc(MEM_OTHER, line, cap);
+        }
+        line[len++] = c;
+    }
+    line[len] = '\0';
+    int status = (r == 1 && c == '\n') ? 0 : 1;
+
+    static char* reply[] = {"REPLY", NULL};
+    char** names = argv[i] ? argv + i : reply;
+    const char* ifs = get_var("IFS");
+    if (ifs == NULL) {
+        ifs = " \t\n";
+    }
+    char* p = line;
+    for (int k = 0; names[k] != NULL; k++) {
+        while (*p && strchr(ifs, *p) && is_ifs(*p)) {
+            p++;
+        }
+        if (names[k + 1] == NULL) {
+            // The last variable gets the rest without trailing blanks
+            char* end = p + strlen(p);
+            while (end > p && strchr(ifs, end[-1]) && is_ifs(end[-1])) {
+                end--;
+            }
+            *end = '\0';
+            set_var(names[k], p);
+            break;
+        }
+        char* q = p + strcspn(p, ifs);
+        char sep = *q;
+        *q = '\0';
+        set_var(names[k], p);
+        p = sep ? q + 1 : q;
+    }
+    mem_free(MEM_OTHER, line);
+    return status;
+}
+
+static int parse_limits(char** argv, struct limits* lim);
+
+// limit is handled by execute_pipeline(), which strips it off the command;
+// this only runs when no command follows the options
+static int builtin_limit(char** argv, struct builtin_io* io) {
+    struct limits lim;
+    return parse_limits(argv, &lim) < 0 ? 2 : 0;
+}
+
+// "pprof" alone; before a pipeline it is stripped by execute_pipeline()
+static int builtin_pprof(char** argv, struct builtin_io* io) {
+    dprintf(io->err, "usage: pprof command | command ...\n");
+    return 2;
+}
+
+// "pstat" alone; with a command it is stripped by execute_pipeline()
+static int builtin_pstat(char** argv, struct builtin_io* io) {
+    dprintf(io->err, "usage: pstat command\n");
+    return 2;
+}
+
+// Command history. Each distinct line is stored once in a string arena and
+// an entry is only the id of its string, so a repeated command costs four
+// bytes. A hash set over the strings finds an earlier copy of a line, which
+// also makes $HISTCONTROL cheap: ignoredups, erasedups, ignorespace, ignoreboth.
+struct hist_string {
+    uint32_t offset;  // Start of the NUL-terminated line in the arena
+    uint32_t length;
+    uint32_t hash;
+    uint32_t refs;    // Entries using it; its bytes are garbage at 0
+};
+
+struct history {
+    char* arena;
+    size_t arena_len;
+    size_t arena_cap;
+    size_t garbage;               // Arena bytes of strings no entry uses
+    struct hist_string* strings;
+    uint32_t string_count;
+    uint32_t string_cap;
+    uint32_t* set;                // Open addressing: string id + 1, 0 when empty
+    uint32_t set_cap;             // Power of two, at least twice string_count
+    uint32_t* entries;            // String id of each entry, live from first to end
+    uint32_t first;
+    uint32_t end;
+    uint32_t entry_cap;
+    long base;                    // Number of the oldest entry, as used by !N
+};
+
+struct history shell_history = {.base = 1};
+
+// Slot of line in the hash set: the one holding its string, or the empty
+// slot where it belongs
+static uint32_t* hist_slot(const char* line, uint32_t hash) {
+    struct history* h = &shell_history;
+    for (uint32_t i = hash & (h->set_cap - 1);; i = (i + 1) & (h->set_cap - 1)) {
+        uint32_t id = h->set[i];
+        if (id == 0 || (h->strings[id - 1].hash == hash && strcmp(h->arena + h->strings[id - 1].offset, line) == 0)) {
+            return &h->set[i];
+        }
+    }
+}
+
+// Copy the strings still in use into a fresh arena and rebuild the hash
+// set at twice their count. Runs when garbage outweighs live text or the
+// set fills up, so it is amortized over the additions that caused it.
+static void hist_rebuild(void) {
+    struct history* h = &shell_history;
+    uint32_t* remap = mem_malloc(MEM_HISTORY, (h->string_count + 1) * sizeof(uint32_t));
+    char* arena = mem_malloc(MEM_HISTORY, h->arena_len - h->garbage + 1);
+    size_t len = 0;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < h->string_count; i++) {
+        struct hist_string s = h->strings[i];
+        if (s.refs == 0) {
+            continue;
+        }
+        memcpy(arena + len, h->arena + s.offset, s.length + 1);
+        s.offset = len;
+        len += s.length + 1;
+        remap[i] = count;
+        h->strings[count++] = s;
+    }
+    mem_free(MEM_HISTORY, h->arena);
+    h->arena = arena;
+    h->arena_len = h->arena_cap = len;
+    h->garbage = 0;
+    h->string_count = count;
+    for (uint32_t i = h->first; i < h->end; i++) {
+        h->entries[i] = remap[h->entries[i]];
+    }
+    mem_free(MEM_HISTORY, remap);
+
+    while (h->set_cap < 64 || h->set_cap < (count + 1) * 2) {
+        h->set_cap = h->set_cap ? h->set_cap * 2 : 64;
+    }
+    mem_free(MEM_HISTORY, h->set);
+    h->set = mem_calloc(MEM_HISTORY, h->set_cap, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        *hist_slot(h->arena + h->strings[i].offset, h->strings[i].hash) = i + 1;
+    }
+}
+
+// Id of the string holding line, added to the arena if it is new
+static uint32_t hist_intern(const char* line) {
+    struct history* h = &shell_history;
+    if (h->set == NULL || (h->string_count + 1) * 2 > h->set_cap ||
+        (h->garbage > 4096 && h->garbage * 2 > h->arena_len)) {
+        hist_rebuild();
+    }
+    uint32_t hash = fnv_hash(line);
+    uint32_t* slot = hist_slot(line, hash);
+    if (*slot != 0) {
+        struct hist_string* s = &h->strings[*slot - 1];
+        if (s->refs == 0) {
+            h->garbage -= s->length + 1;  // Used again before a rebuild
+        }
+        return *slot - 1;
+    }
+    size_t length = strlen(line);
+    while (h->arena_len + length + 1 > h->arena_cap) {
+        h->arena_cap = h->arena_cap ? h->arena_cap * 2 : 4096;
+        h->arena = mem_realloc(MEM_HISTORY, h->arena, h->arena_cap);
+    }
+    if (h->string_count == h->string_cap) {
+        h->string_cap = h->string_cap ? h->string_cap * 2 : 64;
+        h->strings = mem_realloc(MEM_HISTORY, h->strings, h->string_cap * sizeof(struct hist_string));
+    }
+    memcpy(h->arena + h->arena_len, line, length + 1);
+    h->strings[h->string_count] = (struct hist_string){h->arena_len, length, hash, 0};
+    h->arena_len += length + 1;
+    *slot = ++h->string_count;
+    return h->string_count - 1;
+}
+
+// Drop a reference to a string; unused strings become arena garbage
+static void hist_release(uint32_t id) {
+    struct hist_string* s = &shell_history.strings[id];
+    if (--s->refs == 0) {
+        shell_history.garbage += s->length + 1;
+    }
+}
+
+// History suggestions: while the cursor is at the end of the line, the
+// likeliest history line starting with what was typed is shown in grey,
+// and the right arrow accepts it. Lines go into a radix trie twice, once
+// under the directory they ran in ("cwd\nline") and once under "\nline"
+// for anywhere, and suggestions from the current directory win. Each use
+// adds suggest_unit to a line's score, and the unit grows by SUGGEST_GROWTH
+// per line added, which ages older uses without touching their scores. So
+// only the line just used changes, each node can cache the best line below
+// it, and a lookup is a walk down the typed text. Like the history, the
+// trie keeps two keys per $HISTSIZE line: when it holds twice that many,
+// the lowest scoring half is dropped.
+struct sug_node {
+    char* label;              // Edge from the parent
+    uint32_t key_len;         // Length of the key down to the end of this node
+    double score;             // Weight of the line ending here, 0 if none
+    struct sug_node* best;    // Highest scoring line end in this subtree
+    struct sug_node* parent;
+    struct sug_node** kids;   // Sorted by the first character of their labels
+    int kid_count;
+};
+
+struct sug_node suggest_root = {.label = ""};
+double suggest_unit = 1;      // Weight of a use now
+long suggest_lines = 0;       // Nodes with a score
+
+static int sug_find(struct sug_node* n, char c, int* found) {
+    int lo = 0, hi = n->kid_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((unsigned char)n->kids[mid]->label[0] < (unsigned char)c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = lo < n->kid_count && n->kids[lo]->label[0] == c;
+    return lo;
+}
+
+static struct sug_node* sug_new(struct sug_node* parent, const char* label, size_t len) {
+    struct sug_node* n = mem_calloc(MEM_HISTORY, 1, sizeof(struct sug_node));
+    n->label = mem_strndup(MEM_HISTORY, label, len);
+    n->key_len = parent->key_len + len;
+    n->parent = parent;
+    return n;
+}
+
+static void sug_insert_kid(struct sug_node* n, int i, struct sug_node* kid) {
+    n->kids = mem_realloc(MEM_HISTORY, n->kids, (n->kid_count + 1) * sizeof(struct sug_node*));
+    memmove(n->kids + i + 1, n->kids + i, (n->kid_count - i) * sizeof(struct sug_node*));
+    n->kids[i] = kid;
+    n->kid_count++;
+    kid->parent = n;
+}
+
+// Add one use of key, worth suggest_unit
+static void sug_add_key(const char* key) {
+    struct sug_node* n = &suggest_root;
+    const char* p = key;
+    while (*p) {
+        int found, i = sug_find(n, *p, &found);
+        if (!found) {
+            sug_insert_kid(n, i, sug_new(n, p, strlen(p)));
+            n = n->kids[i];
+            break;
+        }
+        struct sug_node* kid = n->kids[i];
+        size_t common = 0;
+        while (kid->label[common] && kid->label[common] == p[common]) {
+            common++;
+        }
+        if (kid->label[common] != '\0') {
+            // Split the edge where the key leaves it
+            struct sug_node* mid = sug_new(n, kid->label, common);
+            memmove(kid->label, kid->label + common, strlen(kid->label + common) + 1);
+            mid->best = kid->best;
+            n->kids[i] = mid;
+            sug_insert_kid(mid, 0, kid);
+            kid = mid;
+        }
+        n = kid;
+        p += common;
+    }
+    suggest_lines += n->score == 0;
+    n->score += suggest_unit;
+    // Only this line's score went up, so it is the new best wherever it
+    // beats the old one, and nowhere above a node where it does not
+    for (struct sug_node* a = n; a != NULL; a = a->parent) {
+        if (a->best == NULL || a->best == n || a->best->score < n->score) {
+            a->best = n;
+        } else {
+            break;
+        }
+    }
+}
+
+// Scale every score down by the same power of two before the unit overflows
+static void sug_rescale(struct sug_node* n, double factor) {
+    n->score *= factor;
+    for (int i = 0; i < n->kid_count; i++) {
+        sug_rescale(n->kids[i], factor);
+    }
+}
+
+// Highest score first
+static int compare_scores(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x < y) - (x > y);
+}
+
+static void sug_collect(struct sug_node* n, double* scores, long* count) {
+    if (n->score > 0) {
+        scores[(*count)++] = n->score;
+    }
+    for (int i = 0; i < n->kid_count; i++) {
+        sug_collect(n->kids[i], scores, count);
+    }
+}
+
+// Drop the lines scoring below threshold, then the nodes left without a
+// line or kids. A node left with one kid and no line takes the kid's
+// place, so the trie stays a radix trie. The best lines are worked out
+// again from the bottom up.
+static void sug_prune(struct sug_node* n, double threshold) {
+    if (n->score < threshold) {
+        n->score = 0;
+    }
+    suggest_lines += n->score > 0;
+    int kept = 0;
+    for (int i = 0; i < n->kid_count; i++) {
+        struct sug_node* kid = n->kids[i];
+        sug_prune(kid, threshold);
+        if (kid->score == 0 && kid->kid_count == 0) {
+            mem_free(MEM_HISTORY, kid->label);
+            mem_free(MEM_HISTORY, kid->kids);
+            mem_free(MEM_HISTORY, kid);
+        } else {
+            n->kids[kept++] = kid;
+        }
+    }
+    n->kid_count = kept;
+    if (n->parent != NULL && n->score == 0 && n->kid_count == 1) {
+        struct sug_node* kid = n->kids[0];
+        size_t len = strlen(n->label);
+        n->label = mem_realloc(MEM_HISTORY, n->label, len + strlen(kid->label) + 1);
+        strcpy(n->label + len, kid->label);
+        n->key_len = kid->key_len;
+        n->score = kid->score;
+        mem_free(MEM_HISTORY, n->kids);
+        n->kids = kid->kids;
+        n->kid_count = kid->kid_count;
+        for (int i = 0; i < n->kid_count; i++) {
+            n->kids[i]->parent = n;
+        }
+        mem_free(MEM_HISTORY, kid->label);
+        mem_free(MEM_HISTORY, kid);
+    }
+    n->best = n->score > 0 ? n : NULL;
+    for (int i = 0; i < n->kid_count; i++) {
+        struct sug_node* b = n->kids[i]->best;
+        if (b != NULL && (n->best == NULL || b->score > n->best->score)) {
+            n->best = b;
+        }
+    }
+}
+
+// Keep the keep highest scoring lines
+static void sug_trim(long keep) {
+    double* scores = mem_malloc(MEM_HISTORY, suggest_lines * sizeof(double));
+    long count = 0;
+    sug_collect(&suggest_root, scores, &count);
+    qsort(scores, count, sizeof(double), compare_scores);
+    double threshold = count > keep ? scores[keep - 1] : 0;
+    mem_free(MEM_HISTORY, scores);
+    suggest_lines = 0;
+    sug_prune(&suggest_root, threshold);
+}
+
+// Key of a directory scope: the working directory followed by a newline
+static size_t suggest_scope(char* key, size_t size) {
+    if (getcwd(key, size - 1) == NULL) {
+        key[0] = '\0';
+    }
+    size_t len = strlen(key);
+    key[len++] = '\n';
+    return len;
+}
+
+// Record a line just added to the history
+static void suggest_add(const char* line) {
+    size_t len = strlen(line);
+    char* key = mem_malloc(MEM_HISTORY, MAX_LEN + len + 2);
+    size_t scope = suggest_scope(key, MAX_LEN);
+    memcpy(key + scope, line, len + 1);
+    sug_add_key(key);
+    sug_add_key(key + scope - 1);  // "\nline", the same line in no particular directory
+    mem_free(MEM_HISTORY, key);
+    suggest_unit *= SUGGEST_GROWTH;
+    if (suggest_unit > 0x1p500) {
+        sug_rescale(&suggest_root, 0x1p-500);
+        suggest_unit *= 0x1p-500;
+    }
+    const char* size = get_var("HISTSIZE");
+    long limit = size ? atol(size) : HISTORY_SIZE;
+    limit = 2 * (limit > 0 ? limit : 1);
+    if (suggest_lines > 2 * limit) {
+        sug_trim(limit);
+    }
+}
+
+// Only the line editors show suggestions; a library build without the
+// built-in editor has none
+#if defined(BUILTIN_EDITOR) || !defined(PUCITSH_LIB)
+// Best line under key, returned as what follows key in it, or NULL
+static const char* sug_lookup(const char* key) {
+    static char* text;
+    static size_t cap;
+    struct sug_node* n = &suggest_root;
+    const char* p = key;
+    while (*p) {
+        int found, i = sug_find(n, *p, &found);
+        if (!found) {
+            return NULL;
+        }
+        struct sug_node* kid = n->kids[i];
+        size_t common = 0;
+        while (kid->label[common] && kid->label[common] == p[common]) {
+            common++;
+        }
+        if (kid->label[common] != '\0' && p[common] != '\0') {
+            return NULL;  // Diverges inside the edge
+        }
+        n = kid;
+        p += common;
+    }
+    struct sug_node* best = n->best;
+    size_t key_len = strlen(key);
+    if (best == NULL || best->key_len <= key_len) {
+        return NULL;
+    }
+    if (best->key_len + 1 > cap) {
+        cap = best->key_len + 1;
+        text = mem_realloc(MEM_HISTORY, text, cap);
+    }
+    text[best->key_len] = '\0';
+    for (struct sug_node* a = best; a->parent != NULL; a = a->parent) {
+        size_t len = strlen(a->label);
+        memcpy(text + a->key_len - len, a->label, len);
+    }
+    return text + key_len;
+}
+
+// The rest of the suggested line for what has been typed, or NULL
+static const char* suggest(const char* typed) {
+    if (typed[0] == '\0' || suggest_root.kid_count == 0) {
+        return NULL;
+    }
+    size_t len = strlen(typed);
+    char* key = mem_malloc(MEM_HISTORY, MAX_LEN + len + 2);
+    size_t scope = suggest_scope(key, MAX_LEN);
+    memcpy(key + scope, typed, len + 1);
+    const char* rest = sug_lookup(key);
+    if (rest == NULL) {
+        rest = sug_lookup(key + scope - 1);
+    }
+    mem_free(MEM_HISTORY, key);
+    return rest;
+}
+#endif
+
+// Add a command line to the history, keeping the newest $HISTSIZE entries
+// (default HISTORY_SIZE)
+void add_to_history(const char* cmd) {
+    struct history* h = &shell_history;
+    const char* control = get_var("HISTCONTROL");
+    control = control ? control : "";
+    int both = strstr(control, "ignoreboth") != NULL;
+    int erase = strstr(control, "erasedups") != NULL;
+    int ignore = erase || both || strstr(control, "ignoredups") != NULL;
+    if (cmd[0] == '\0' || ((both || strstr(control, "ignorespace")) && cmd[0] == ' ')) {
+        return;
+    }
+    suggest_add(cmd);  // Every use counts for suggestions, even when not kept
+    if (ignore && h->end > h->first && strcmp(get_history_command(h->base + h->end - h->first - 1), cmd) == 0) {
+        return;
+    }
+#ifndef BUILTIN_EDITOR
+    add_history(cmd);  // Readline keeps its own stifled copy for line editing
+#endif
+
+    uint32_t id = hist_intern(cmd);
+    if (erase && h->strings[id].refs > 0) {
+#ifndef BUILTIN_EDITOR
+        for (int i = history_length - 2; i >= 0; i--) {
+            HIST_ENTRY* entry = history_get(history_base + i);
+            if (entry != NULL && strcmp(entry->line, cmd) == 0) {
+                free_history_entry(remove_history(i));
+                break;
+            }
+        }
+#endif
+        // erasedups: the line has one entry at most, found from the newest end
+        uint32_t i = h->end;
+        while (h->entries[--i] != id) {
+        }
+        memmove(h->entries + i, h->entries + i + 1, (h->end - i - 1) * sizeof(uint32_t));
+        h->end--;
+        h->strings[id].refs--;
+    }
+    if (h->end == h->entry_cap) {
+        if (h->first > h->entry_cap / 2) {
+            // Most of the table is dropped entries: slide the live ones down
+            memmove(h->entries, h->entries + h->first, (h->end - h->first) * sizeof(uint32_t));
+            h->end -= h->first;
+            h->first = 0;
+        } else {
+            h->entry_cap = h->entry_cap ? h->entry_cap * 2 : 64;
+            h->entries = mem_realloc(MEM_HISTORY, h->entries, h->entry_cap * sizeof(uint32_t));
+        }
+    }
+    h->entries[h->end++] = id;
+    h->strings[id].refs++;
+
+    const char* size = get_var("HISTSIZE");
+    long limit = size ? atol(size) : HISTORY_SIZE;
+    while (h->end - h->first > (limit > 0 ? limit : 1)) {
+        hist_release(h->entries[h->first++]);
+        h->base++;
+    }
+}
+
+// Number of history entries
+static int hist_count(void) {
+    return shell_history.end - shell_history.first;
+}
+
+// Entry i of the history, 0 being the oldest kept
+static const char* hist_line(int i) {
+    return shell_history.arena + shell_history.strings[shell_history.entries[shell_history.first + i]].offset;
+}
+
+// Command from history by its number (1 for the first one ever added while
+// it is kept), NULL if out of range. Valid until the next addition.
+const char* get_history_command(int index) {
+    struct history* h = &shell_history;
+    long i = index - h->base;
+    if (i < 0 || i >= hist_count()) {
+        return NULL;
+    }
+    return hist_line(i);
+}
+
+// history [n]: list the last n entries with the numbers !N takes
+static int builtin_history(char** argv, struct builtin_io* io) {
+    int count = hist_count();
+    int n = argv[1] ? atoi(argv[1]) : count;
+    char* text;
+    size_t len;
+    FILE* f = open_memstream(&text, &len);
+    for (int i = n < count ? count - n : 0; i < count; i++) {
+        fprintf(f, "%5ld  %s\n", shell_history.base + i, get_history_command(shell_history.base + i));
+    }
+    return flush_output(f, &text, &len, io->out);
+}
+
+// memstat: live and peak bytes of the shell's own allocations by category,
+// and the process RSS they contribute to
+static int builtin_memstat(char** argv, struct builtin_io* io) {
+#ifdef NO_MEMSTAT
+    printf("memstat: allocation tracking was compiled out (NO_MEMSTAT)\n");
+#else
+    static const char* names[] = {"parse", "expand", "env", "jobs", "history", "other", "all"};
+    printf("%-8s %10s %10s %12s %12s %14s\n", "category", "allocs", "frees", "live bytes", "peak bytes", "total bytes");
+    for (int i = 0; i <= MEM_CATEGORIES; i++) {
+        struct mem_stats st = mem_stats[i];
+        printf("%-8s %10ld %10ld %12zu %12zu %14zu\n", names[i], st.allocs, st.frees, st.live, st.peak, st.total);
+    }
+#endif
+#ifndef BUILTIN_EDITOR
+    printf("readline history: %d entries, %d bytes\n", history_length, history_total_bytes());
+#endif
+    printf("history: %d entries, %u lines, %zu arena bytes (%zu unused)\n", hist_count(),
+           shell_history.string_count, shell_history.arena_len, shell_history.garbage);
+    long pages = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%*d %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("rss: %ldK now, %ldK peak\n", pages * (sysconf(_SC_PAGESIZE) / 1024), ru.ru_maxrss);
+    return 0;
+}
+
+static int builtin_help(char** argv, struct builtin_io* io);
+
+static const struct builtin builtins[] = {
+    {"cd", builtin_cd, 0, "cd <dir>   - Change the working directory to <dir>"},
+    {"exit", builtin_exit, 0, "exit [n]   - Exit the shell"},
+    {"jobs", builtin_jobs, 0, "jobs [-l]  - List jobs; jobs -o [%job] [-n lines] [-w file] - Show a job's spooled output"},
+    {"fg", builtin_fg, 0, "fg [%job]  - Continue a job in the foreground"},
+    {"bg", builtin_bg, 0, "bg [%job]  - Continue a stopped job in the background"},
+    {"kill", builtin_kill, 0, "kill [-SIG] <pid|%job> - Send SIG (default KILL) to a process or a whole job"},
+    {"help", builtin_help, 0, "help       - Display this help message"},
+    {"export", builtin_export, 0, "export <name>[=<value>] - Pass a variable on to commands"},
+    {"unset", builtin_unset, 0, "unset <name> - Remove a variable"},
+    {"alias", builtin_alias, 0, "alias [name[=value]...] - Define or list aliases"},
+    {"unalias", builtin_unalias, 0, "unalias [-a] <name...> - Remove aliases"},
+    {"source", builtin_source, 0, "source <file> [arg...] - Run a file's commands in this shell"},
+    {".", builtin_source, 0, ".  <file> [arg...] - Same as source"},
+    {"shift", builtin_shift, 0, "shift [n]  - Drop the first n positional parameters"},
+    {"break", builtin_break, 0, "break [n]  - Leave the n innermost loops"},
+    {"continue", builtin_continue, 0, "continue [n] - Start the next round of the n-th loop"},
+    {"return", builtin_return, 0, "return [n] - Return from a function"},
+    {"echo", builtin_echo, 1, "echo [-neE] [arg...] - Print the arguments"},
+    {"printf", builtin_printf, 1, "printf <format> [arg...] - Print the arguments in a format"},
+    {"test", builtin_test, 1, "test <expr> - Check files, strings and numbers"},
+    {"[", builtin_test, 1, "[ <expr> ]  - Same as test"},
+    {"read", builtin_read, 0, "read [-r] [-p prompt] [name...] - Read a line into variables"},
+    {"true", builtin_true, 1, "true       - Succeed"},
+    {"false", builtin_false, 1, "false      - Fail"},
+    {":", builtin_true, 1, ":          - Do nothing and succeed"},
+    {"pwd", builtin_pwd, 1, "pwd        - Print the working directory"},
+    {"history", builtin_history, 1, "history [n] - List the last n commands, numbered for !N"},
+    {"memstat", builtin_memstat, 0, "memstat    - Show the shell's memory use by category"},
+    {"audit", builtin_audit, 0, "audit      - Show where commands are logged and how many records were dropped"},
+    {"pprof", builtin_pprof, 0, "pprof <cmd> | <cmd> ... - Run a pipeline through relays and report its slowest stage"},
+    {"pstat", builtin_pstat, 0, "pstat <cmd> - Run cmd and print its IPC, cache and branch miss rates"},
+    {"limit", builtin_limit, 0, "limit [--cpu T] [--mem SIZE] [--wall T] [--nofile N] [--grace T] <cmd> - Run cmd with limits"},
+    {NULL, NULL, 0, NULL},
+};
+
+static int builtin_help(char** argv, struct builtin_io* io) {
+    printf("Available commands:\n");
+    for (int i = 0; builtins[i].name != NULL; i++) {
+        printf("%s\n", builtins[i].help);
+    }
+    printf("Control flow: if, while, until, for, { }, ( ), name() { }, &&, ||, ;\n");
+    return 0;
+}
+
+static const struct builtin* find_builtin(const char* name) {
+    for (int i = 0; builtins[i].name != NULL; i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+// Run a function or builtin on the standard descriptors; -1 if name is neither
+static int run_command(char** argv) {
+    struct function* f = find_function(argv[0]);
+    if (f != NULL) {
+        return call_function(f, argv);
+    }
+    const struct builtin* b = find_builtin(argv[0]);
+    if (b == NULL) {
+        return -1;
+    }
+    struct builtin_io io = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    int status = b->fn(argv, &io);
+    fflush(stdout);  // Keep printf() output of builtins in order with write()
+    return status;
+}
+
+// Thread body of a builtin pipeline stage. Closing its pipe ends when it
+// is done gives the neighbouring stages EOF, as a child exiting would.
+static void* run_stage_thread(void* arg) {
+    struct stage_thread* t = arg;
+    // A write to a closed pipe fails with EPIPE here instead of killing the shell
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    t->status = t->builtin->fn(t->argv, &t->io);
+    for (int k = 0; k < t->owned_count; k++) {
+        close(t->owned[k]);
+    }
+    return NULL;
+}
+
+// Body of a pprof relay: splice() moves pages from one pipe to the next
+// without copying them. When the relay has to wait, it notes which side
+// holds it up. Waiting to write means the downstream stage's pipe is
+// full. Waiting to read while that pipe is empty means the downstream
+// stage is starved.
+static void* run_relay(void* arg) {
+    struct relay* r = arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);  // A reader that exited gives EPIPE
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    r->pipe_size = fcntl(r->out, F_GETPIPE_SZ);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        ssize_t n = splice(r->in, NULL, r->out, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            r->bytes += n;
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            break;  // The upstream stage is done, or the downstream one exited
+        }
+        int queued_in = 0, queued_out = 0;
+        ioctl(r->in, FIONREAD, &queued_in);
+        ioctl(r->out, FIONREAD, &queued_out);
+        r->queued += queued_out;
+        r->samples++;
+        // With input waiting the output is full; otherwise wait for input,
+        // waking every PPROF_SAMPLE_MS to see whether the output ran dry
+        struct pollfd p = {queued_in > 0 ? r->out : r->in, queued_in > 0 ? POLLOUT : POLLIN, 0};
+        struct timespec waited;
+        clock_gettime(CLOCK_MONOTONIC, &waited);
+        poll(&p, 1, queued_in > 0 || queued_out == 0 ? -1 : PPROF_SAMPLE_MS);
+        double ms = elapsed_ms(&waited);
+        if (queued_in > 0) {
+            r->full_ms += ms;
+        } else if (queued_out == 0) {
+            r->empty_ms += ms;
+        }
+    }
+    r->total_ms = elapsed_ms(&start);
+    close(r->in);
+    close(r->out);  // EOF for the downstream stage
+    if (__atomic_exchange_n(&r->detached, -1, __ATOMIC_ACQ_REL) == 1) {
+        mem_free(MEM_JOBS, r);
+    }
+    return NULL;
+}
+
+// pprof: put a relay into the pipe fd between two stages. The upstream
+// stage keeps fd[1]; the downstream one gets a new read end in fd[0].
+static struct relay* start_relay(int fd[2]) {
+    int next[2];
+    if (pipe2(next, O_CLOEXEC) < 0) {
+        return NULL;
+    }
+    struct relay* r = mem_calloc(MEM_JOBS, 1, sizeof(struct relay));
+    r->in = fd[0];
+    r->out = next[1];
+    if (pthread_create(&r->thread, NULL, run_relay, r) != 0) {
+        close(next[0]);
+        close(next[1]);
+        mem_free(MEM_JOBS, r);
+        return NULL;
+    }
+    fd[0] = next[0];
+    return r;
+}
+
+// Print the pprof report of a finished pipeline: one line per pipe, then
+// the stage that held the rest up. A stage is slow when its input pipe
+// stays full and its output pipe stays empty, so each stage scores the
+// share of time its relays saw either.
+static void report_relays(struct relay** relays, int count, char (*names)[ARGLEN]) {
+    double worst = -1;
+    int slowest = 0;
+    for (int i = 0; i < count; i++) {
+        struct relay* r = relays[i];
+        double t = r->total_ms > 0 ? r->total_ms : 1;
+        fprintf(stderr, "pprof: %s | %s: %.1f MB, %.1f MB/s, full %.0f%%, empty %.0f%%, %.1f of %d KiB queued\n",
+                names[i], names[i + 1], r->bytes / 1e6, r->bytes / 1e3 / t, 100 * r->full_ms / t,
+                100 * r->empty_ms / t, r->samples ? r->queued / r->samples / 1024.0 : 0, r->pipe_size / 1024);
+    }
+    for (int s = 0; s <= count; s++) {
+        double in = s > 0 ? relays[s - 1]->full_ms / (relays[s - 1]->total_ms + 1e-9) : -1;
+        double out = s < count ? relays[s]->empty_ms / (relays[s]->total_ms + 1e-9) : -1;
+        // The first and last stages have one side only
+        double score = in < 0 ? out : out < 0 ? in : (in + out) / 2;
+        if (score > worst) {
+            worst = score;
+            slowest = s;
+        }
+    }
+    fprintf(stderr, "pprof: slowest stage: %d (%s), holding up its pipes %.0f%% of the time\n", slowest + 1,
+            names[slowest], 100 * worst);
+}
+
+// Wait for the relays of a pprof pipeline and report, or if the job
+// stopped leave them to finish and free themselves
+static void finish_relays(struct relay** relays, int count, char (*names)[ARGLEN], int stopped) {
+    for (int i = 0; i < count; i++) {
+        if (stopped) {
+            pthread_detach(relays[i]->thread);
+            if (__atomic_exchange_n(&relays[i]->detached, 1, __ATOMIC_ACQ_REL) == -1) {
+                mem_free(MEM_JOBS, relays[i]);  // It was done already
+            }
+        } else {
+            pthread_join(relays[i]->thread, NULL);
+        }
+    }
+    if (!stopped && count > 0) {
+        report_relays(relays, count, names);
+    }
+    for (int i = 0; i < count && !stopped; i++) {
+        mem_free(MEM_JOBS, relays[i]);
+    }
+}
+
+static void background_sched(struct sched_spec* spec);
+static void apply_sched(const struct sched_spec* spec);
+static int start_background(struct node* n);
+
+// Run a list item that ends in & without waiting for it, its output
+// spooled while $PUCITSH_SPOOL is set
+static int run_background(struct node* n) {
+    new_spool();
+    int status = start_background(n);
+    end_spool();
+    return status;
+}
+
+static int start_background(struct node* n) {
+    if (n->type == NODE_COMMAND) {
+        return execute_pipeline(&n, 1, 1);
+    }
+    if (n->type == NODE_PIPELINE) {
+        return execute_pipeline(n->kids, n->kid_count, 1);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    fork_count++;
+    if (pid == 0) {
+        enter_job(0, 0);
+        forget_jobs();
+        enter_spool();
+        struct sched_spec spec = {.policy = -1};
+        background_sched(&spec);
+        apply_sched(&spec);
+        exit_child(run_node(n));
+    } else if (pid < 0) {
+        perror("Fork failed");
+        return 1;
+    }
+    if (job_control) {
+        setpgid(pid, pid);
+    }
+    struct job* j = new_job(job_control ? pid : 0, &pid, 1, &n, 1);
+    if (add_job(j) < 0) {
+        free_job(j);
+        return 1;
+    }
+    printf("[%d] %d\n", j->id, pid);
+    return 0;
+}
+
+// After a loop body: 1 if break, continue N or return leaves this loop
+static int leave_loop(void) {
+    if (break_levels > 0) {
+        break_levels--;
+        return 1;
+    }
+    if (continue_levels > 1) {
+        continue_levels--;
+        return 1;
+    }
+    continue_levels = 0;
+    return returning || interrupted;
+}
+
+static int redirect_in_shell(char** words, struct saved_fds* saved);
+static void restore_fds(struct saved_fds* saved);
+static void finish_atomic_outputs(struct atomic_output* mark, int status);
+
+// Run a parsed command and return its exit status
+int run_node(struct node* n) {
+    int tail = tail_position && !(n->flags & NODE_NEGATE);  // Only its last command inherits it
+    tail_position = 0;
+    int status = 0;
+    struct saved_fds saved = {0};
+    struct atomic_output* mark = pending_outputs;
+    if (n->redirs != NULL) {
+        struct capture* captures = NULL;
+        char** words = expand_words(n->redirs, &captures);
+        int failed = redirect_in_shell(words, &saved) < 0;
+        mem_free(MEM_EXPAND, words);
+        free_captures(captures);
+        if (failed) {
+            restore_fds(&saved);
+            finish_atomic_outputs(mark, 1);
+            return last_status = 1;
+        }
+    }
+
+    switch (n->type) {
+    case NODE_COMMAND:
+        tail_position = tail;
+        status = execute_pipeline(&n, 1, 0);
+        break;
+    case NODE_PIPELINE:
+        status = execute_pipeline(n->kids, n->kid_count, 0);
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        status = run_node(n->kids[0]);
+        if ((status == 0) == (n->type == NODE_AND) && !break_levels && !continue_levels && !returning &&
+            !interrupted) {
+            tail_position = tail;
+            status = run_node(n->kids[1]);
+        }
+        break;
+    case NODE_LIST:
+        for (int i = 0; i < n->kid_count && !break_levels && !continue_levels && !returning && !interrupted; i++) {
+            struct node* kid = n->kids[i];
+            tail_position = tail && i == n->kid_count - 1 && !(kid->flags & NODE_BACKGROUND);
+            status = (kid->flags & NODE_BACKGROUND) ? run_background(kid) : run_node(kid);
+            last_status = status;
+        }
+        break;
+    case NODE_IF:
+        if (run_node(n->kids[0]) == 0) {
+            tail_position = tail;
+            status = run_node(n->kids[1]);
+        } else if (n->kid_count > 2) {
+            tail_position = tail;
+            status = run_node(n->kids[2]);
+        }
+        break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        loop_depth++;
+        while ((run_node(n->kids[0]) == 0) == (n->type == NODE_WHILE)) {
+            status = run_node(n->kids[1]);
+            if (leave_loop()) {
+                break;
+            }
+        }
+        loop_depth--;
+        break;
+    case NODE_FOR: {
+        struct capture* captures = NULL;
+        char** items = n->flags & NODE_ALL_ARGS ? NULL : expand_words(n->words, &captures);
+        char** args = items ? items : positional;
+        int count = positional_count;
+        loop_depth++;
+        for (int i = 0; items ? args[i] != NULL : i < count; i++) {
+            set_var(n->name, args[i]);
+            status = run_node(n->kids[0]);
+            if (leave_loop()) {
+                break;
+            }
+        }
+        loop_depth--;
+        mem_free(MEM_EXPAND, items);
+        free_captures(captures);
+        break;
+    }
+    case NODE_GROUP:
+        tail_position = tail;
+        status = run_node(n->kids[0]);
+        break;
+    case NODE_SUBSHELL: {
+        fflush(stdout);
+        pid_t pid = fork();
+        fork_count++;
+        if (pid == 0) {
+            enter_job(0, 1);
+            forget_jobs();
+            tail_position = nothing_after_last();
+            exit_child(run_node(n->kids[0]));
+        } else if (pid < 0) {
+            perror("Fork failed");
+            status = 1;
+        } else {
+            if (job_control) {
+                setpgid(pid, pid);
+            }
+            struct job* j = new_job(job_control ? pid : 0, &pid, 1, &n, 1);
+            status = foreground_job(j, 0);
+            if (j->id == 0) {
+                free_job(j);
+            }
+        }
+        break;
+    }
+    case NODE_FUNCTION:
+        define_function(n->name, n->kids[0]);
+        break;
+    }
+
+    restore_fds(&saved);
+    finish_atomic_outputs(mark, status);
+    if (n->flags & NODE_NEGATE) {
+        status = !status;
+    }
+    return last_status = status;
+}
+
+// Parse the redirection operator at the start of word. Returns the operator
+// length and sets fd to the descriptor it applies to, or returns 0.
+static int parse_redirect(const char* word, int* fd, const char** op) {
+    static const char* ops[] = {"<<<", "<<", "&>>", "&>", ">>", ">&", "<&", ">!", ">", "<", NULL};
+    const char* p = word;
+    int explicit_fd = -1;
+    if (*p >= '0' && *p <= '9') {
+        explicit_fd = 0;
+        while (*p >= '0' && *p <= '9') {
+            explicit_fd = explicit_fd * 10 + (*p++ - '0');
+        }
+    }
+    for (int i = 0; ops[i] != NULL; i++) {
+        size_t n = strlen(ops[i]);
+        if (strncmp(p, ops[i], n) != 0) {
+            continue;
+        }
+        if (ops[i][0] == '&' && explicit_fd >= 0) {
+            return 0;
+        }
+        if (n == 1 && p[1] == '(') {
+            return 0;  // Process substitution, not a redirection
+        }
+        *op = ops[i];
+        *fd = explicit_fd >= 0 ? explicit_fd : (ops[i][0] == '<' ? STDIN_FILENO : STDOUT_FILENO);
+        return (p - word) + n;
+    }
+    return 0;
+}
+
+// Move a shell-owned descriptor to REDIRECT_FD_MIN or above so it cannot
+// collide with a descriptor the user redirects, keeping it close-on-exec
+static int move_fd_high(int fd) {
+    if (fd < 0 || fd >= REDIRECT_FD_MIN) {
+        return fd;
+    }
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FD_MIN);
+    close(fd);
+    return high;
+}
+
+// >! target: the command writes to a file with no name in the target's
+// directory, kept on pending_outputs until its status is known. Existing
+// targets pass their permissions on to the new file.
+static int open_atomic_output(const char* target) {
+    const char* slash = strrchr(target, '/');
+    char* dirname = slash ? mem_strndup(MEM_EXPAND, target, slash == target ? 1 : slash - target)
+                          : mem_strdup(MEM_EXPAND, ".");
+    const char* name = slash ? slash + 1 : target;
+    struct stat st;
+    int exists = stat(target, &st) == 0;
+    int dir = -1, fd = -1;
+    if (*name == '\0' || (exists && S_ISDIR(st.st_mode))) {
+        errno = EISDIR;
+    } else if ((dir = open(dirname, O_PATH | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        fd = openat(dir, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+    }
+    mem_free(MEM_EXPAND, dirname);
+    if (fd < 0) {
+        fprintf(stderr, "%s: cannot write atomically: %s\n", target, strerror(errno));
+        if (dir >= 0) {
+            close(dir);
+        }
+        return -1;
+    }
+    if (exists && S_ISREG(st.st_mode)) {
+        fchmod(fd, st.st_mode & 07777);
+    }
+    struct atomic_output* o = mem_malloc(MEM_JOBS, sizeof(struct atomic_output));
+    o->fd = move_fd_high(fd);
+    o->dir = move_fd_high(dir);
+    o->name = mem_strdup(MEM_JOBS, name);
+    o->next = pending_outputs;
+    pending_outputs = o;
+    return o->fd;
+}
+
+// Give the file of a >! its target's name if status is 0, else let it
+// vanish. linkat() cannot replace a name, so an existing target is
+// replaced by linking the file to a hidden name and renaming that over it.
+static void finish_atomic_output(struct atomic_output* o, int status) {
+    if (status == 0) {
+        char path[32], hidden[MAX_LEN];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", o->fd);
+        int failed = linkat(AT_FDCWD, path, o->dir, o->name, AT_SYMLINK_FOLLOW) < 0;
+        if (failed && errno == EEXIST) {
+            snprintf(hidden, sizeof(hidden), ".%s.%d~", o->name, (int)getpid());
+            unlinkat(o->dir, hidden, 0);  // Left over from a shell that died in between
+            failed = linkat(AT_FDCWD, path, o->dir, hidden, AT_SYMLINK_FOLLOW) < 0 ||
+                     renameat(o->dir, hidden, o->dir, o->name) < 0;
+            if (failed) {
+                int err = errno;
+                unlinkat(o->dir, hidden, 0);
+                errno = err;
+            }
+        }
+        if (failed) {
+            fprintf(stderr, "%s: %s\n", o->name, strerror(errno));
+        }
+    }
+    close(o->fd);
+    close(o->dir);
+    mem_free(MEM_JOBS, o->name);
+    mem_free(MEM_JOBS, o);
+}
+
+// Finish the >! outputs opened since pending_outputs was mark
+static void finish_atomic_outputs(struct atomic_output* mark, int status) {
+    while (pending_outputs != mark) {
+        struct atomic_output* o = pending_outputs;
+        pending_outputs = o->next;
+        finish_atomic_output(o, status);
+    }
+}
+
+// Take the >! outputs opened since mark, for a job to finish when it is done
+static struct atomic_output* take_atomic_outputs(struct atomic_output* mark) {
+    struct atomic_output* taken = pending_outputs;
+    struct atomic_output** p = &taken;
+    while (*p != mark) {
+        p = &(*p)->next;
+    }
+    *p = NULL;
+    pending_outputs = mark;
+    return taken;
+}
+
+// Open the file or here-document for one redirection, or return the
+// descriptor to copy. Returns -2 on error.
+static int redirect_source(const char* op, const char* target, int* owned) {
+    int fd = -1;
+    *owned = 1;
+    if (strcmp(op, "<<<") == 0) {
+        // Here-string: the word plus a newline becomes the input
+        char* body = mem_malloc(MEM_EXPAND, strlen(target) + 2);
+        sprintf(body, "%s\n", target);
+        fd = heredoc_fd(body, strlen(body));
+        mem_free(MEM_EXPAND, body);
+    } else if (strcmp(op, "<<") == 0) {
+        // Here-document: the parser stored the body after the delimiter line
+        const char* body = strchr(target, '\n');
+        body = body ? body + 1 : "";
+        fd = heredoc_fd(body, strlen(body));
+    } else if (strcmp(op, ">&") == 0 || strcmp(op, "<&") == 0) {
+        *owned = 0;
+        if (strcmp(target, "-") == 0) {
+            return -1;
+        }
+        char* end;
+        long n = strtol(target, &end, 10);
+        if (*end != '\0' || n < 0) {
+            fprintf(stderr, "%s: bad file descriptor\n", target);
+            return -2;
+        }
+        return n;
+    } else if (strcmp(op, ">!") == 0) {
+        *owned = 0;  // The shell keeps it until the command's status is known
+        return open_atomic_output(target) < 0 ? -2 : pending_outputs->fd;
+    } else if (strcmp(op, "<") == 0) {
+        fd = open(target, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror("Failed to open input file");
+        }
+    } else {
+        int flags = O_CREAT | O_WRONLY | O_CLOEXEC;
+        flags |= strstr(op, ">>") ? O_APPEND : O_TRUNC;
+        fd = open(target, flags, 0644);
+        if (fd < 0) {
+            perror("Failed to open output file");
+        }
+    }
+    return fd < 0 ? -2 : move_fd_high(fd);
+}
+
+// Close every descriptor from 3 up except those listed in keep
+static void close_other_fds(int* keep, int nkeep) {
+    // Sort so the gaps between kept descriptors can be closed as ranges
+    for (int i = 1; i < nkeep; i++) {
+        for (int j = i; j > 0 && keep[j - 1] > keep[j]; j--) {
+            int t = keep[j];
+            keep[j] = keep[j - 1];
+            keep[j - 1] = t;
+        }
+    }
+    unsigned int low = 3;
+    for (int i = 0; i < nkeep; i++) {
+        if (keep[i] < (int)low) {
+            continue;
+        }
+        if (keep[i] > (int)low) {
+            close_range(low, keep[i] - 1, 0);
+        }
+        low = keep[i] + 1;
+    }
+    close_range(low, ~0U, 0);
+}
+
+// Collect the redirections of an argument vector in order, opening their
+// files, and drop them from the arguments. Returns the number of arguments
+// left, or -1 after reporting an error.
+static int collect_redirects(char** arglist, struct redirect* redirs, int max, int* redir_count) {
+    int argc = 0;
+    *redir_count = 0;
+    for (int j = 0; arglist[j] != NULL; j++) {
+        int target_fd;
+        const char* op;
+        int n = parse_redirect(arglist[j], &target_fd, &op);
+        if (n == 0) {
+            arglist[argc++] = arglist[j];
+            continue;
+        }
+        const char* target = arglist[j][n] ? &arglist[j][n] : arglist[++j];
+        if (target == NULL || *redir_count + 2 > max) {
+            fprintf(stderr, "%s: missing redirection target\n", op);
+            arglist[argc] = NULL;
+            return -1;
+        }
+        int owned;
+        int source = redirect_source(op, target, &owned);
+        if (source == -2) {
+            arglist[argc] = NULL;
+            return -1;
+        }
+        redirs[(*redir_count)++] = (struct redirect){target_fd, source, owned};
+        if (op[0] == '&') {
+            // &> sends stderr to the same place as stdout
+            redirs[(*redir_count)++] = (struct redirect){STDERR_FILENO, STDOUT_FILENO, 0};
+        }
+    }
+    arglist[argc] = NULL;
+    return argc;
+}
+
+// Apply redirections to the shell itself around a builtin, function or
+// compound command. The replaced descriptors are saved for restore_fds().
+static int redirect_in_shell(char** words, struct saved_fds* saved) {
+    struct redirect redirs[MAXARGS * 2];
+    int redir_count;
+    int failed = collect_redirects(words, redirs, MAXARGS * 2, &redir_count) < 0;
+    fflush(stdout);
+    for (int k = 0; k < redir_count; k++) {
+        int fd = redirs[k].fd;
+        if (!failed && saved->count < MAXARGS * 2) {
+            saved->fd[saved->count] = fd;
+            saved->copy[saved->count++] = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FD_MIN);
+            if (redirs[k].source < 0) {
+                close(fd);
+            } else if (redirs[k].source != fd && dup2(redirs[k].source, fd) < 0) {
+                perror("Redirection failed");
+                failed = 1;
+            }
+        }
+        if (redirs[k].owned) {
+            close(redirs[k].source);
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+// Put back the descriptors replaced by redirect_in_shell()
+static void restore_fds(struct saved_fds* saved) {
+    if (saved->count > 0) {
+        fflush(stdout);
+    }
+    for (int k = saved->count - 1; k >= 0; k--) {
+        if (saved->copy[k] >= 0) {
+            dup2(saved->copy[k], saved->fd[k]);
+            close(saved->copy[k]);
+        } else {
+            close(saved->fd[k]);
+        }
+    }
+    saved->count = 0;
+}
+
+// Expand a simple command into its arguments. Leading NAME=value words
+// are expanded separately into *assigns.
+static char** expand_command(struct node* cmd, char*** assigns, struct capture** captures) {
+    int n = 0;
+    char** words = NULL;
+    int count = 0;
+    add_word(&words, &count, NULL);
+    count = 0;
+    while (n < cmd->word_count && is_assignment(cmd->words[n])) {
+        add_word(&words, &count, expand_assignment(cmd->words[n++], captures));
+    }
+    *assigns = words;  // Built with the parser's add_word(), freed as MEM_PARSE
+    return expand_words(cmd->words + n, captures);
+}
+
+// First argument that is not part of a redirection, NULL if there is none
+static const char* command_name(char** argv) {
+    for (int i = 0; argv[i] != NULL; i++) {
+        int fd;
+        const char* op;
+        int n = parse_redirect(argv[i], &fd, &op);
+        if (n == 0) {
+            return argv[i];
+        }
+        if (argv[i][n] == '\0' && argv[i + 1] != NULL) {
+            i++;  // Target in the next word
+        }
+    }
+    return NULL;
+}
+
+// Run a builtin, a function call or plain assignments in the shell itself
+static int run_in_shell(char** argv, char** assigns) {
+    struct saved_fds saved = {0};
+    int status = 0;
+    if (redirect_in_shell(argv, &saved) < 0) {
+        status = 1;
+    } else if (argv[0] == NULL) {
+        for (int i = 0; assigns[i] != NULL; i++) {
+            assign(assigns[i]);
+        }
+        status = subst_status;
+    } else {
+        // NAME=value before a builtin or function lasts for that command only
+        char* old[MAXARGS];
+        int count = 0;
+        for (; assigns[count] != NULL && count < MAXARGS; count++) {
+            *strchr(assigns[count], '=') = '\0';
+            const char* value = get_var(assigns[count]);
+            old[count] = value ? mem_strdup(MEM_ENV, value) : NULL;
+            set_var(assigns[count], assigns[count] + strlen(assigns[count]) + 1);
+        }
+        status = run_command(argv);
+        for (int i = count - 1; i >= 0; i--) {
+            if (old[i] != NULL) {
+                set_var(assigns[i], old[i]);
+                mem_free(MEM_ENV, old[i]);
+            } else {
+                unset_var(assigns[i]);
+            }
+            assigns[i][strlen(assigns[i])] = '=';
+        }
+    }
+    restore_fds(&saved);
+    return status;
+}
+
+// Seconds in "10s", "500ms", "2m", "1h" or a plain number; -1 if malformed
+static double parse_duration(const char* text) {
+    char* end;
+    double v = strtod(text, &end);
+    if (end == text || v < 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        return v / 1000;
+    }
+    if (*end == '\0' || strcmp(end, "s") == 0) {
+        return v;
+    }
+    if (strcmp(end, "m") == 0) {
+        return v * 60;
+    }
+    if (strcmp(end, "h") == 0) {
+        return v * 3600;
+    }
+    return -1;
+}
+
+// Bytes in "2G", "512M", "64K" or a plain number; 0 if malformed
+static rlim_t parse_size(const char* text) {
+    char* end;
+    double v = strtod(text, &end);
+    const char* units = "KMGT";
+    const char* unit = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+    if (end == text || v <= 0 || (*end && (unit == NULL || (end[1] && strcmp(end + 1, "B") != 0)))) {
+        return 0;
+    }
+    for (int i = 0; unit && i <= unit - units; i++) {
+        v *= 1024;
+    }
+    return (rlim_t)v;
+}
+
+// Parse the options of "limit [--cpu T] [--mem SIZE] [--wall T] [--nofile N]
+// [--grace T] command...". Returns the index of the command, or -1 after
+// reporting an error.
+static int parse_limits(char** argv, struct limits* lim) {
+    memset(lim, 0, sizeof(*lim));
+    lim->grace = LIMIT_GRACE;
+    int i = 1;
+    for (; argv[i] != NULL && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        const char* opt = argv[i] + 2;
+        const char* value = argv[i + 1];
+        int bad = value == NULL;
+        if (bad) {
+            // Reported below
+        } else if (strcmp(opt, "cpu") == 0) {
+            bad = (lim->cpu = parse_duration(value)) <= 0;
+        } else if (strcmp(opt, "wall") == 0) {
+            bad = (lim->wall = parse_duration(value)) <= 0;
+        } else if (strcmp(opt, "grace") == 0) {
+            bad = (lim->grace = parse_duration(value)) < 0;
+        } else if (strcmp(opt, "mem") == 0) {
+            bad = (lim->mem = parse_size(value)) == 0;
+        } else if (strcmp(opt, "nofile") == 0) {
+            bad = (lim->nofile = strtoul(value, NULL, 10)) == 0;
+        } else {
+            fprintf(stderr, "limit: unknown option %s\n", argv[i]);
+            return -1;
+        }
+        if (bad) {
+            fprintf(stderr, "limit: bad value for %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (argv[i] == NULL) {
+        fprintf(stderr, "usage: limit [--cpu T] [--mem SIZE] [--wall T] [--nofile N] [--grace T] command\n");
+        return -1;
+    }
+    lim->active = 1;
+    snprintf(lim->command, sizeof(lim->command), "%s", argv[i]);
+    return i;
+}
+
+// Apply the resource limits in the child before it runs the command. The
+// hard CPU limit is a second above the soft one: SIGXCPU first, then SIGKILL.
+static void apply_limits(const struct limits* lim) {
+    struct rlimit rl;
+    if (lim->cpu > 0) {
+        rl.rlim_cur = (rlim_t)(lim->cpu + 0.999);
+        rl.rlim_max = rl.rlim_cur + 1;
+        setrlimit(RLIMIT_CPU, &rl);
+    }
+    if (lim->mem > 0) {
+        rl.rlim_cur = rl.rlim_max = lim->mem;
+        setrlimit(RLIMIT_AS, &rl);
+    }
+    if (lim->nofile > 0) {
+        rl.rlim_cur = rl.rlim_max = lim->nofile;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            perror("limit: nofile");
+        }
+    }
+}
+
+static void arm_timer(int tfd, double seconds) {
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = (time_t)seconds;
+    its.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+        its.it_value.tv_nsec = 1;  // A zero time would disarm the timer
+    }
+    timerfd_settime(tfd, 0, &its, NULL);
+}
+
+// Watchdog thread: wait on the pidfd and the timerfd. When the wall time
+// is up send SIGTERM, and SIGKILL once the grace period has passed too.
+// pidfd_send_signal() cannot hit a recycled pid after the child is reaped.
+static void* run_watchdog(void* arg) {
+    struct watchdog* wd = arg;
+    struct pollfd fds[2] = {{wd->pidfd, POLLIN, 0}, {wd->timerfd, POLLIN, 0}};
+    while (wd->sent != SIGKILL) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[0].revents) {
+            break;  // The command has exited
+        }
+        uint64_t expirations;
+        if (read(wd->timerfd, &expirations, sizeof(expirations)) < 0) {
+            continue;
+        }
+        wd->sent = wd->sent == 0 ? SIGTERM : SIGKILL;
+        syscall(SYS_pidfd_send_signal, wd->pidfd, wd->sent, NULL, 0);
+        if (wd->sent == SIGTERM) {
+            arm_timer(wd->timerfd, wd->limits.grace);
+        }
+        if (wd->detached) {
+            fprintf(stderr, "limit: %s (pid %d): wall time %gs exceeded, sent %s\n",
+                    wd->limits.command, wd->pid, wd->limits.wall, wd->sent == SIGTERM ? "SIGTERM" : "SIGKILL");
+        }
+    }
+    if (wd->detached) {
+        close(wd->pidfd);
+        close(wd->timerfd);
+        mem_free(MEM_JOBS, wd);
+    }
+    return NULL;
+}
+
+// Enforce the wall-clock limit of a forked command from the shell. For a
+// background job the watchdog is detached and reports by itself.
+static struct watchdog* start_watchdog(pid_t pid, const struct limits* lim, int background) {
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (pidfd < 0 || tfd < 0) {
+        perror("limit: cannot watch the command");
+        close(pidfd);
+        close(tfd);
+        return NULL;
+    }
+    struct watchdog* wd = mem_calloc(MEM_JOBS, 1, sizeof(struct watchdog));
+    wd->pid = pid;
+    wd->pidfd = move_fd_high(pidfd);
+    wd->timerfd = move_fd_high(tfd);
+    wd->limits = *lim;
+    wd->detached = background;
+    arm_timer(wd->timerfd, lim->wall);
+    if (pthread_create(&wd->thread, NULL, run_watchdog, wd) != 0) {
+        perror("limit: cannot start watchdog");
+        close(wd->pidfd);
+        close(wd->timerfd);
+        mem_free(MEM_JOBS, wd);
+        return NULL;
+    }
+    if (background) {
+        pthread_detach(wd->thread);
+        return NULL;
+    }
+    return wd;
+}
+
+// Exit record of a limited command: report the limit that stopped it.
+// wd is the foreground watchdog, joined and freed here.
+static void finish_limits(const struct limits* lim, struct watchdog* wd, int st) {
+    int sent = 0;
+    if (wd != NULL) {
+        pthread_join(wd->thread, NULL);
+        sent = wd->sent;
+        close(wd->pidfd);
+        close(wd->timerfd);
+        mem_free(MEM_JOBS, wd);
+    }
+    int sig = WIFSIGNALED(st) ? WTERMSIG(st) : 0;
+    if (sent != 0) {
+        fprintf(stderr, "limit: %s: wall time %gs exceeded, sent %s (status %d)\n", lim->command, lim->wall,
+                sent == SIGKILL ? "SIGTERM then SIGKILL" : "SIGTERM", wait_status(st));
+    } else if (lim->cpu > 0 && (sig == SIGXCPU || sig == SIGKILL)) {
+        fprintf(stderr, "limit: %s: cpu time %gs exceeded (status %d)\n", lim->command, lim->cpu, wait_status(st));
+    } else if (lim->mem > 0 && (sig == SIGSEGV || sig == SIGABRT || sig == SIGKILL)) {
+        fprintf(stderr, "limit: %s: killed by signal %d, probably at the memory limit of %lluK\n", lim->command,
+                sig, (unsigned long long)lim->mem / 1024);
+    }
+}
+
+// Parse a CPU list such as "0-3,8,10-11" into set
+static int parse_cpu_list(const char* text, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* p = text;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Parse one @key=value annotation into spec. Returns 1 for an annotation,
+// 0 for an ordinary word and -1 after reporting a bad one.
+static int parse_sched_word(const char* word, struct sched_spec* spec) {
+    static const struct {
+        const char* name;
+        int policy;
+    } policies[] = {
+        {"other", SCHED_OTHER}, {"batch", SCHED_BATCH}, {"idle", SCHED_IDLE},
+        {"fifo", SCHED_FIFO}, {"rr", SCHED_RR}, {NULL, 0},
+    };
+    if (word[0] != '@' || strchr(word, '=') == NULL) {
+        return 0;
+    }
+    const char* value = strchr(word, '=') + 1;
+    char* end;
+    if (strncmp(word, "@cpus=", 6) == 0) {
+        if (parse_cpu_list(value, &spec->cpus) == 0 && CPU_COUNT(&spec->cpus) > 0) {
+            spec->has_cpus = 1;
+            return 1;
+        }
+    } else if (strncmp(word, "@nice=", 6) == 0) {
+        spec->nice = strtol(value, &end, 10);
+        if (end != value && *end == '\0') {
+            spec->has_nice = 1;
+            return 1;
+        }
+    } else if (strncmp(word, "@sched=", 7) == 0) {
+        // batch, idle and other; fifo and rr take a priority as fifo:10
+        for (int i = 0; policies[i].name != NULL; i++) {
+            size_t n = strlen(policies[i].name);
+            if (strncmp(value, policies[i].name, n) == 0 && (value[n] == '\0' || value[n] == ':')) {
+                spec->policy = policies[i].policy;
+                spec->priority = value[n] ? atoi(value + n + 1) : 0;
+                if ((spec->policy == SCHED_FIFO || spec->policy == SCHED_RR) && spec->priority < 1) {
+                    spec->priority = 1;
+                }
+                return 1;
+            }
+        }
+    } else {
+        fprintf(stderr, "%s: unknown annotation\n", word);
+        return -1;
+    }
+    fprintf(stderr, "%s: bad value\n", word);
+    return -1;
+}
+
+// Strip the leading @key=value annotations of a command into spec.
+// Returns how many there were, or -1 after an error.
+static int strip_sched(char** argv, struct sched_spec* spec) {
+    int n = 0, r;
+    while (argv[n] != NULL && (r = parse_sched_word(argv[n], spec)) != 0) {
+        if (r < 0) {
+            return -1;
+        }
+        n++;
+    }
+    if (n > 0) {
+        int rest = 0;
+        while (argv[n + rest] != NULL) {
+            rest++;
+        }
+        memmove(argv, argv + n, (rest + 1) * sizeof(char*));
+    }
+    return n;
+}
+
+// Default annotations for & jobs from $PUCITSH_BG_SCHED, e.g. "@nice=10 @sched=batch"
+static void background_sched(struct sched_spec* spec) {
+    const char* text = get_var("PUCITSH_BG_SCHED");
+    if (text == NULL) {
+        return;
+    }
+    char* copy = mem_strdup(MEM_OTHER, text);
+    for (char* word = strtok(copy, " \t"); word != NULL; word = strtok(NULL, " \t")) {
+        if (parse_sched_word(word, spec) == 0) {
+            fprintf(stderr, "PUCITSH_BG_SCHED: %s: not an annotation\n", word);
+        }
+    }
+    mem_free(MEM_OTHER, copy);
+}
+
+// Apply a stage's affinity, niceness and policy in its child before exec
+static void apply_sched(const struct sched_spec* spec) {
+    if (spec->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &spec->cpus) < 0) {
+        perror("sched_setaffinity failed");
+    }
+    if (spec->policy >= 0) {
+        struct sched_param param = {.sched_priority = spec->priority};
+        if (sched_setscheduler(0, spec->policy, &param) < 0) {
+            perror("sched_setscheduler failed");
+        }
+    }
+    if (spec->has_nice && setpriority(PRIO_PROCESS, 0, spec->nice) < 0) {
+        perror("setpriority failed");
+    }
+}
+
+// Run a pipeline of simple and compound commands. A lone builtin, function
+// call or assignment runs in the shell itself; every other stage is forked.
+int execute_pipeline(struct node** stages, int cmd_count, int background) {
+    int fd[2], in_fd = STDIN_FILENO;
+    int status = 0;
+    pid_t pids[cmd_count * (MAXARGS + 1)];  // Stages plus their process substitutions
+    int pid_count = 0;
+    pid_t last_pid = -1;
+    pid_t pgid = 0;  // Process group of the job: its first forked stage
+    struct stage_thread threads[cmd_count];
+    int thread_count = 0;
+    struct stage_thread* last_thread = NULL;
+    int pid_stage[cmd_count * (MAXARGS + 1)];  // Stage of each pid, -1 for substitutions
+    struct limits limits[cmd_count];
+    struct watchdog* watchdogs[cmd_count];
+    struct sched_spec scheds[cmd_count];
+    struct counters* counters[cmd_count];  // Stages run under pstat
+    int pstat[cmd_count];
+    int must_fork = 0;  // Annotated and measured stages run in a child of their own
+    struct atomic_output* mark = pending_outputs;  // >! files of the stages are opened above it
+    int profile = 0;    // pprof: relays between the stages
+    struct relay* relays[cmd_count];
+    int relay_count = 0;
+    char names[cmd_count][ARGLEN];  // Stage names for the pprof report
+    int tail = tail_position && cmd_count == 1 && !background;  // May exec in place of a child
+    tail_position = 0;
+
+    // Expand the words of every simple command up front
+    struct capture* captures = NULL;
+    char** argvs[cmd_count];
+    char** assigns[cmd_count];
+    subst_status = 0;
+    int bad_limits = 0;
+    for (int i = 0; i < cmd_count; i++) {
+        argvs[i] = assigns[i] = NULL;
+        limits[i].active = 0;
+        watchdogs[i] = NULL;
+        scheds[i] = (struct sched_spec){.policy = -1};
+        counters[i] = NULL;
+        pstat[i] = 0;
+        if (background) {
+            background_sched(&scheds[i]);
+        }
+        if (stages[i]->type == NODE_COMMAND) {
+            argvs[i] = expand_command(stages[i], &assigns[i], &captures);
+            int n = strip_sched(argvs[i], &scheds[i]);
+            if (n < 0) {
+                bad_limits = 1;
+                continue;
+            }
+            must_fork |= n > 0;
+            // pprof pipeline: relays measure every pipe of it
+            if (i == 0 && argvs[i][0] != NULL && strcmp(argvs[i][0], "pprof") == 0 && argvs[i][1] != NULL) {
+                int n = 0;
+                while (argvs[i][n + 1] != NULL) {
+                    n++;
+                }
+                memmove(argvs[i], argvs[i] + 1, (n + 1) * sizeof(char*));
+                profile = !background;
+            }
+            // pstat command: count the stage's hardware events
+            if (argvs[i][0] != NULL && strcmp(argvs[i][0], "pstat") == 0 && argvs[i][1] != NULL) {
+                int n = 0;
+                while (argvs[i][n + 1] != NULL) {
+                    n++;
+                }
+                memmove(argvs[i], argvs[i] + 1, (n + 1) * sizeof(char*));
+                pstat[i] = must_fork = 1;
+            }
+            // limit [options] command: the options apply to this stage's child
+            if (argvs[i][0] != NULL && strcmp(argvs[i][0], "limit") == 0 && argvs[i][1] != NULL) {
+                int skip = parse_limits(argvs[i], &limits[i]);
+                if (skip < 0) {
+                    bad_limits = 1;
+                    continue;
+                }
+                int n = 0;
+                while (argvs[i][skip + n] != NULL) {
+                    n++;
+                }
+                memmove(argvs[i], argvs[i] + skip, (n + 1) * sizeof(char*));
+            }
+        }
+    }
+    for (int i = 0; i < cmd_count && profile; i++) {
+        names[i][0] = '\0';
+        if (argvs[i] != NULL && argvs[i][0] != NULL) {
+            snprintf(names[i], ARGLEN, "%s", argvs[i][0]);
+        } else {
+            node_text(stages[i], names[i], ARGLEN);
+        }
+    }
+    if (bad_limits) {
+        for (int i = 0; i < cmd_count; i++) {
+            mem_free(MEM_EXPAND, argvs[i]);
+            mem_free(MEM_PARSE, assigns[i]);
+        }
+        free_captures(captures);
+        return 2;
+    }
+
+    if (cmd_count == 1 && !background && argvs[0] != NULL && !limits[0].active && !must_fork) {
+        const char* name = command_name(argvs[0]);
+        if (name == NULL || find_function(name) != NULL || find_builtin(name) != NULL) {
+            forks_avoided += name != NULL;
+            status = run_in_shell(argvs[0], assigns[0]);
+            finish_atomic_outputs(mark, status);
+            mem_free(MEM_EXPAND, argvs[0]);
+            mem_free(MEM_PARSE, assigns[0]);
+            free_captures(captures);
+            return status;
+        }
+    }
+
+    for (int i = 0; i < cmd_count; i++) {
+        // Create pipe for the current command
+        fd[0] = fd[1] = -1;
+        if (i < cmd_count - 1 && pipe2(fd, O_CLOEXEC) < 0) {
+            perror("Failed to create pipe");
+            status = -1;
+            break;
+        }
+        if (profile && fd[0] >= 0 && (relays[relay_count] = start_relay(fd)) != NULL) {
+            relay_count++;
+        }
+
+        char** arglist = argvs[i];
+        int failed = 0;
+
+        // Process substitution: start each <(cmd) and >(cmd) now so it runs
+        // alongside the stage, and pass its pipe end as /dev/fd/N
+        int subst_fds[MAXARGS];
+        char subst_paths[MAXARGS][ARGLEN];
+        int subst_count = 0;
+        for (int j = 0; arglist != NULL && arglist[j] != NULL && subst_count < MAXARGS; j++) {
+            int reading = strncmp(arglist[j], "<(", 2) == 0;
+            int writing = strncmp(arglist[j], ">(", 2) == 0;
+            size_t len = strlen(arglist[j]);
+            if ((!reading && !writing) || arglist[j][len - 1] != ')') {
+                continue;
+            }
+            int sfd[2];
+            if (pipe2(sfd, O_CLOEXEC) < 0) {
+                perror("Failed to create pipe");
+                failed = 1;
+                break;
+            }
+            arglist[j][len - 1] = '\0';
+            pid_t spid = reading ? spawn_subshell(arglist[j] + 2, STDIN_FILENO, sfd[1])
+                                 : spawn_subshell(arglist[j] + 2, sfd[0], STDOUT_FILENO);
+            arglist[j][len - 1] = ')';
+            close(reading ? sfd[1] : sfd[0]);
+            int keep = move_fd_high(reading ? sfd[0] : sfd[1]);
+            if (spid < 0) {
+                close(keep);
+                failed = 1;
+                break;
+            }
+            pid_stage[pid_count] = -1;
+            pids[pid_count++] = spid;
+            snprintf(subst_paths[subst_count], ARGLEN, "/dev/fd/%d", keep);
+            arglist[j] = subst_paths[subst_count];
+            subst_fds[subst_count++] = keep;
+        }
+
+        // Collect redirections in order and drop them from the arguments
+        struct redirect redirs[MAXARGS * 2];
+        int redir_count = 0;
+        if (arglist != NULL && !failed) {
+            int argc = collect_redirects(arglist, redirs, MAXARGS * 2, &redir_count);
+            if (argc < 0) {
+                failed = 1;
+            } else if (argc == 0 && cmd_count > 1) {
+                fprintf(stderr, "Missing command in pipeline\n");
+                failed = 1;
+            }
+        }
+
+        // A simple builtin stage of a foreground pipeline runs on a thread
+        // that reads and writes the pipe ends directly
+        const struct builtin* tb = NULL;
+        if (!failed && !background && arglist != NULL && arglist[0] != NULL && !limits[i].active && !must_fork &&
+            assigns[i][0] == NULL && subst_count == 0 && find_function(arglist[0]) == NULL) {
+            tb = find_builtin(arglist[0]);
+            tb = tb && tb->threadable ? tb : NULL;
+        }
+        if (tb != NULL) {
+            struct stage_thread* t = &threads[thread_count];
+            int io[3] = {in_fd, fd[1] >= 0 ? fd[1] : STDOUT_FILENO, STDERR_FILENO};
+            for (int k = 0; k < redir_count; k++) {
+                if (redirs[k].fd <= STDERR_FILENO) {
+                    int src = redirs[k].source;
+                    io[redirs[k].fd] = src >= 0 && src <= STDERR_FILENO ? io[src] : src;
+                }
+            }
+            *t = (struct stage_thread){.builtin = tb, .argv = arglist, .io = {io[0], io[1], io[2]}};
+            // The thread owns the pipe ends and files of its stage from here on
+            for (int k = 0; k < redir_count; k++) {
+                if (redirs[k].owned) {
+                    t->owned[t->owned_count++] = redirs[k].source;
+                }
+            }
+            if (in_fd != STDIN_FILENO) {
+                t->owned[t->owned_count++] = in_fd;
+            }
+            if (fd[1] >= 0) {
+                t->owned[t->owned_count++] = fd[1];
+            }
+            if (pthread_create(&t->thread, NULL, run_stage_thread, t) == 0) {
+                thread_count++;
+                forks_avoided++;
+                last_thread = t;
+                last_pid = -1;
+                in_fd = fd[0] >= 0 ? fd[0] : STDIN_FILENO;
+                continue;
+            }
+            tb = NULL;  // Fall back to forking
+        }
+
+        // A pstat stage waits on this pipe until its counters are open
+        int sync_fd[2] = {-1, -1};
+        if (!failed && pstat[i] && pipe2(sync_fd, O_CLOEXEC) < 0) {
+            perror("Failed to create pipe");
+            failed = 1;
+        }
+
+        int pid = -1;
+        if (!failed) {
+            fflush(stdout);
+            if (tail && arglist != NULL && arglist[0] != NULL && !must_fork && !limits[i].active &&
+                subst_count == 0 && pending_outputs == NULL) {
+                // The shell's last command: be the child and exec it
+                pid = 0;
+            } else {
+                pid = fork();
+                fork_count++;
+            }
+        }
+        if (pid == 0) {
+            enter_job(pgid, !background);
+            forget_jobs();
+            enter_spool();
+            if (sync_fd[0] >= 0) {
+                char c;
+                close(sync_fd[1]);
+                while (read(sync_fd[0], &c, 1) < 0 && errno == EINTR) {
+                }
+            }
+            // Child process: pipe ends first, then redirections in order
+            if (in_fd != STDIN_FILENO) {
+                dup2(in_fd, STDIN_FILENO);
+            }
+            if (fd[1] >= 0) {
+                dup2(fd[1], STDOUT_FILENO);
+            }
+            int keep[MAXARGS * 3];
+            int keep_count = 0;
+            for (int k = 0; k < redir_count; k++) {
+                if (redirs[k].source < 0) {
+                    close(redirs[k].fd);
+                } else if (redirs[k].source == redirs[k].fd) {
+                    fcntl(redirs[k].fd, F_SETFD, 0);
+                } else if (dup2(redirs[k].source, redirs[k].fd) < 0) {
+                    perror("Redirection failed");
+                    exit_child(1);
+                }
+                if (redirs[k].source >= 0) {
+                    keep[keep_count++] = redirs[k].fd;
+                }
+            }
+            for (int k = 0; k < subst_count; k++) {
+                fcntl(subst_fds[k], F_SETFD, 0);  // Keep /dev/fd/N open across exec
+                keep[keep_count++] = subst_fds[k];
+            }
+            // Exactly the descriptors this command needs survive into exec
+            close_other_fds(keep, keep_count);
+            apply_sched(&scheds[i]);
+            if (arglist == NULL) {
+                exit_child(run_node(stages[i]));  // Compound command as a stage
+            }
+            for (int k = 0; assigns[i][k] != NULL; k++) {
+                assign(assigns[i][k]);
+                *strchr(assigns[i][k], '=') = '\0';
+                setenv(assigns[i][k], assigns[i][k] + strlen(assigns[i][k]) + 1, 1);
+            }
+            if (arglist[0] == NULL) {
+                exit_child(subst_status);
+            }
+            if (limits[i].active) {
+                apply_limits(&limits[i]);
+            }
+            int st = run_command(arglist);
+            if (st >= 0) {
+                exit_child(st);
+            }
+            run_own_script(arglist);
+            execvp(arglist[0], arglist);
+            perror("Command execution failed");
+            exit_child(1);
+        } else if (pid < 0 && !failed) {
+            perror("Fork failed");
+            failed = 1;
+        }
+
+        // Parent process: close everything the shell opened for this stage
+        if (sync_fd[0] >= 0) {
+            if (pid > 0) {
+                counters[i] = open_counters(pid, arglist[0]);
+            }
+            close(sync_fd[0]);
+            close(sync_fd[1]);  // Lets the child go on to exec
+        }
+        for (int k = 0; k < redir_count; k++) {
+            if (redirs[k].owned) {
+                close(redirs[k].source);
+            }
+        }
+        for (int k = 0; k < subst_count; k++) {
+            close(subst_fds[k]);
+        }
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (fd[1] >= 0) {
+            close(fd[1]);
+        }
+        in_fd = fd[0] >= 0 ? fd[0] : STDIN_FILENO;
+        if (failed) {
+            status = 1;
+            break;
+        }
+        if (job_control) {
+            pgid = pgid ? pgid : pid;
+            setpgid(pid, pgid);  // Also in the child, whichever runs first
+        }
+        if (limits[i].active && limits[i].wall > 0) {
+            watchdogs[i] = start_watchdog(pid, &limits[i], background);
+        }
+        pid_stage[pid_count] = i;
+        pids[pid_count++] = pid;
+        last_pid = pid;
+        last_thread = NULL;
+    }
+    if (in_fd != STDIN_FILENO) {
+        close(in_fd);  // Read end of the last pipe when a stage failed to start
+    }
+    for (int k = 0; k < thread_count; k++) {
+        pthread_join(threads[k].thread, NULL);
+    }
+    if (last_thread != NULL && status == 0) {
+        status = last_thread->status;
+    }
+    for (int i = 0; i < cmd_count; i++) {
+        mem_free(MEM_EXPAND, argvs[i]);
+        mem_free(MEM_PARSE, assigns[i]);
+    }
+    free_captures(captures);
+
+    if (pid_count == 0) {
+        finish_relays(relays, relay_count, names, 0);
+        finish_atomic_outputs(mark, status);
+        return status;
+    }
+    struct job* j = new_job(pgid, pids, pid_count, stages, cmd_count);
+    j->outputs = take_atomic_outputs(mark);
+    for (int k = 0; k < pid_count; k++) {
+        j->procs[k].counters = pid_stage[k] >= 0 ? counters[pid_stage[k]] : NULL;
+    }
+    if (background) {
+        if (add_job(j) < 0) {
+            free_job(j);
+            return 1;
+        }
+        if (last_pid > 0) {
+            printf("[%d] %d\n", j->id, last_pid);  // Print background job id
+        }
+        return status;
+    }
+
+    // Wait for every stage and substitution together once all of them are
+    // running; a stopped job is kept in the job table
+    int job_status = foreground_job(j, 0);
+    if (last_pid > 0 && status == 0) {
+        status = job_status;
+    }
+    finish_relays(relays, relay_count, names, job_state(j) != PROC_DONE);
+    for (int k = 0; k < pid_count; k++) {
+        int s = pid_stage[k];
+        if (s < 0 || !limits[s].active) {
+            continue;
+        }
+        if (j->procs[k].state == PROC_DONE) {
+            finish_limits(&limits[s], watchdogs[s], j->procs[k].status);
+        } else if (watchdogs[s] != NULL) {
+            watchdogs[s]->detached = 1;  // Stopped: the watchdog reports by itself
+            pthread_detach(watchdogs[s]->thread);
+        }
+    }
+    if (j->id == 0) {
+        free_job(j);
+    }
+    return status;
+}
+
+// Store a here-document body in a sealed memfd and return it rewound for reading.
+// Unlike a pipe the whole body is written before the child starts, so bodies
+// larger than the pipe capacity cannot deadlock, and nothing touches /tmp.
+int heredoc_fd(const char* body, size_t len) {
+    int fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create failed");
+        return -1;
+    }
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, body + off, len - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to write here-document");
+            close(fd);
+            return -1;
+        }
+        off += n;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// Run a command line in a forked copy of the shell with the given stdin and stdout
+pid_t spawn_subshell(const char* cmdline, int in_fd, int out_fd) {
+    fflush(stdout);
+    pid_t pid = fork();
+    fork_count++;
+    if (pid == 0) {
+        if (in_fd != STDIN_FILENO) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        close_range(3, ~0U, 0);
+        forget_jobs();
+        struct input in = {0};
+        in.fd = -1;
+        in.text = cmdline;
+        in.exec_last = 1;
+        exit_child(run_input(&in));
+    } else if (pid < 0) {
+        perror("Fork failed");
+    }
+    return pid;
+}
+
+// Growable NULL-terminated argument vector
+struct word_list {
+    char** words;
+    int count;
+    int cap;
+};
+
+static void push_word(struct word_list* wl, char* word) {
+    if (wl->count + 2 > wl->cap) {
+        wl->cap = wl->cap ? wl->cap * 2 : MAXARGS;
+        wl->words = mem_realloc(MEM_EXPAND, wl->words, wl->cap * sizeof(char*));
+    }
+    wl->words[wl->count++] = word;
+    wl->words[wl->count] = NULL;
+}
+
+static void add_capture(struct capture** captures, char* data, size_t map_len) {
+    struct capture* c = mem_malloc(MEM_EXPAND, sizeof(struct capture));
+    c->data = data;
+    c->map_len = map_len;
+    c->next = *captures;
+    *captures = c;
+}
+
+// Run cmdline in a subshell and collect its standard output. The heap buffer
+// grows geometrically and is filled with large read() calls; output past
+// CAPTURE_SPLICE_MIN is spliced into a memfd that is mapped instead, so huge
+// outputs are never copied through user space twice. Trailing newlines are
+// trimmed and the result is NUL-terminated.
+static char* capture_output(const char* cmdline, struct capture** captures) {
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) < 0) {
+        perror("Failed to create pipe");
+        return NULL;
+    }
+    pid_t pid = spawn_subshell(cmdline, STDIN_FILENO, fd[1]);
+    close(fd[1]);
+    if (pid < 0) {
+        close(fd[0]);
+        return NULL;
+    }
+
+    size_t cap = CAPTURE_INITIAL, len = 0, map_len = 0;
+    char* buf = mem_malloc(MEM_EXPAND, cap);
+    ssize_t n;
+    while ((n = read(fd[0], buf + len, cap - len - 1)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        len += n;
+        if (len + 1 == cap) {
+            if (cap >= CAPTURE_SPLICE_MIN) {
+                break;
+            }
+            cap *= 2;
+            buf = mem_realloc(MEM_EXPAND, buf, cap);
+        }
+    }
+
+    if (n > 0) {
+        // Still more output: move what we have into a memfd and splice the rest
+        int mfd = memfd_create("capture", MFD_CLOEXEC);
+        if (mfd >= 0 && write(mfd, buf, len) == (ssize_t)len) {
+            while ((n = splice(fd[0], NULL, mfd, NULL, 1 << 20, SPLICE_F_MOVE)) > 0) {
+                len += n;
+            }
+            map_len = len + 1;
+            ftruncate(mfd, map_len);  // Room for the terminating NUL
+            char* map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, mfd, 0);
+            if (map != MAP_FAILED) {
+                mem_free(MEM_EXPAND, buf);
+                buf = map;
+            } else {
+                perror("Failed to map command output");
+                map_len = 0;
+                len = cap - 1;
+            }
+        } else {
+            perror("Failed to store command output");
+            len = cap - 1;
+        }
+        if (mfd >= 0) {
+            close(mfd);
+        }
+    }
+    close(fd[0]);
+    int st;
+    waitpid(pid, &st, 0);
+    subst_status = wait_status(st);
+
+    while (len > 0 && buf[len - 1] == '\n') {
+        len--;
+    }
+    buf[len] = '\0';
+    add_capture(captures, buf, map_len);
+    return buf;
+}
+
+static int is_ifs(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+// Find the ')' that closes the '(' at p, or NULL if there is none
+static char* find_subst_end(char* p) {
+    struct scan_state st = {0};
+    for (char* start = p; *p; p++) {
+        scan_char(&st, p > start ? p[-1] : 0, *p);
+        if (st.top == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Integer expressions of $((...)): numbers and variables combined with
+// + - * / %, comparisons, unary - and !, and parentheses
+static long arith_compare(char** p);
+
+static void arith_blanks(char** p) {
+    while (is_ifs(**p)) {
+        (*p)++;
+    }
+}
+
+static long arith_primary(char** p) {
+    arith_blanks(p);
+    char c = **p;
+    if (c == '(') {
+        (*p)++;
+        long v = arith_compare(p);
+        arith_blanks(p);
+        if (**p == ')') {
+            (*p)++;
+        }
+        return v;
+    }
+    if (c == '-' || c == '+' || c == '!') {
+        (*p)++;
+        long v = arith_primary(p);
+        return c == '-' ? -v : c == '!' ? !v : v;
+    }
+    if (isdigit((unsigned char)c)) {
+        return strtol(*p, p, 10);
+    }
+    if (c == '$') {
+        (*p)++;
+    }
+    char name[MAX_LEN];
+    int n = 0;
+    while (is_name_char(**p, n == 0) && n < MAX_LEN - 1) {
+        name[n++] = *(*p)++;
+    }
+    name[n] = '\0';
+    const char* value = n ? get_var(name) : NULL;
+    return value ? strtol(value, NULL, 10) : 0;
+}
+
+static long arith_product(char** p) {
+    long v = arith_primary(p);
+    for (;;) {
+        arith_blanks(p);
+        char op = **p;
+        if (op != '*' && op != '/' && op != '%') {
+            return v;
+        }
+        (*p)++;
+        long r = arith_primary(p);
+        if (op == '*') {
+            v *= r;
+        } else if (r == 0) {
+            fprintf(stderr, "division by zero\n");
+            v = 0;
+        } else {
+            v = op == '/' ? v / r : v % r;
+        }
+    }
+}
+
+static long arith_sum(char** p) {
+    long v = arith_product(p);
+    for (;;) {
+        arith_blanks(p);
+        if (**p != '+' && **p != '-') {
+            return v;
+        }
+        char op = *(*p)++;
+        long r = arith_product(p);
+        v = op == '+' ? v + r : v - r;
+    }
+}
+
+static long arith_compare(char** p) {
+    long v = arith_sum(p);
+    for (;;) {
+        arith_blanks(p);
+        char* s = *p;
+        int two = s[1] == '=';
+        if (!((s[0] == '<' || s[0] == '>') || ((s[0] == '=' || s[0] == '!') && two))) {
+            return v;
+        }
+        *p += two ? 2 : 1;
+        long r = arith_sum(p);
+        switch (s[0]) {
+        case '<': v = two ? v <= r : v < r; break;
+        case '>': v = two ? v >= r : v > r; break;
+        case '=': v = v == r; break;
+        default: v = v != r; break;
+        }
+    }
+}
+
+// Value of a special parameter, positional parameter or variable; NULL if unset
+static const char* param_value(const char* name, struct capture** captures) {
+    char buf[32];
+    if (name[0] != '\0' && name[1] == '\0' && strchr("?#$", name[0])) {
+        long v = name[0] == '?' ? last_status : name[0] == '#' ? positional_count : (long)getpid();
+        snprintf(buf, sizeof(buf), "%ld", v);
+        char* s = mem_strdup(MEM_EXPAND, buf);
+        add_capture(captures, s, 0);
+        return s;
+    }
+    if (strcmp(name, "@") == 0 || strcmp(name, "*") == 0) {
+        size_t len = 1;
+        for (int i = 0; i < positional_count; i++) {
+            len += strlen(positional[i]) + 1;
+        }
+        char* s = mem_malloc(MEM_EXPAND, len);
+        s[0] = '\0';
+        for (int i = 0; i < positional_count; i++) {
+            strcat(i ? strcat(s, " ") : s, positional[i]);
+        }
+        add_capture(captures, s, 0);
+        return s;
+    }
+    if (isdigit((unsigned char)name[0])) {
+        int i = atoi(name);
+        return i == 0 ? shell_name : i <= positional_count ? positional[i - 1] : NULL;
+    }
+    return get_var(name);
+}
+
+// Expand the $ expression at p: $((expr)), $(cmd), ${name}, $name or a
+// special parameter. *end is set to its last character. Returns NULL when
+// the '$' starts no expansion and stays literal.
+static const char* expand_dollar(char* p, char** end, struct capture** captures) {
+    char name[MAX_LEN];
+    *end = p;
+    if (p[1] == '(') {
+        char* close = find_subst_end(p + 1);
+        if (close == NULL) {
+            return NULL;
+        }
+        *end = close;
+        if (p[2] == '(' && close[-1] == ')') {
+            close[-1] = '\0';
+            char* expr = p + 3;
+            long v = arith_compare(&expr);
+            close[-1] = ')';
+            char* s = mem_malloc(MEM_EXPAND, 24);
+            snprintf(s, 24, "%ld", v);
+            add_capture(captures, s, 0);
+            return s;
+        }
+        *close = '\0';
+        const char* text = capture_output(p + 2, captures);
+        *close = ')';
+        return text ? text : "";
+    }
+    int n = 0;
+    if (p[1] == '{') {
+        char* close = strchr(p, '}');
+        if (close == NULL || close - p - 2 >= MAX_LEN) {
+            return NULL;
+        }
+        n = close - p - 2;
+        memcpy(name, p + 2, n);
+        *end = close;
+    } else if (is_name_char(p[1], 1)) {
+        while (is_name_char(p[1 + n], 0) && n < MAX_LEN - 1) {
+            name[n] = p[1 + n];
+            n++;
+        }
+        *end = p + n;
+    } else if (p[1] != '\0' && (isdigit((unsigned char)p[1]) || strchr("?#$@*", p[1]))) {
+        name[n++] = p[1];
+        *end = p + 1;
+    } else {
+        return NULL;
+    }
+    name[n] = '\0';
+    const char* value = param_value(name, captures);
+    return value ? value : "";
+}
+
+// Word being assembled by expand_token()
+struct word_builder {
+    char* buf;
+    size_t len;
+    size_t cap;
+    int started;  // A word exists even if it is empty, as for ""
+};
+
+static void wb_putc(struct word_builder* wb, char c) {
+    if (wb->len + 2 > wb->cap) {
+        wb->cap = wb->cap ? wb->cap * 2 : ARGLEN;
+        wb->buf = mem_realloc(MEM_EXPAND, wb->buf, wb->cap);
+    }
+    wb->buf[wb->len++] = c;
+    wb->started = 1;
+}
+
+// Emit the word built so far
+static void wb_finish(struct word_builder* wb, struct word_list* out, struct capture** captures) {
+    if (wb->started) {
+        if (wb->buf == NULL) {
+            wb->buf = mem_malloc(MEM_EXPAND, 1);
+        }
+        wb->buf[wb->len] = '\0';
+        add_capture(captures, wb->buf, 0);
+        push_word(out, wb->buf);
+    }
+    memset(wb, 0, sizeof(*wb));
+}
+
+// Add expanded text to the word; when split is set, blanks in it end words
+static void wb_add(struct word_builder* wb, const char* text, int split,
+                   struct word_list* out, struct capture** captures) {
+    for (; *text; text++) {
+        if (split && is_ifs(*text)) {
+            wb_finish(wb, out, captures);
+        } else {
+            wb_putc(wb, *text);
+        }
+    }
+}
+
+// Expand one token: parameters, $((...)) and $(...) are replaced by their
+// values, which are split into words when unquoted and split is set, a
+// leading ~ becomes $HOME, and quotes are removed. The common case of a
+// token that is just $(cmd) splits the captured buffer in place with no copies.
+static void expand_token(char* token, struct word_list* out, struct capture** captures, int split) {
+    size_t tlen = strlen(token);
+    if (split && tlen > 3 && strncmp(token, "$(", 2) == 0 && token[2] != '(' &&
+        find_subst_end(token + 1) == token + tlen - 1) {
+        token[tlen - 1] = '\0';
+        char* text = capture_output(token + 2, captures);
+        token[tlen - 1] = ')';
+        for (char* p = text; p && *p; ) {
+            while (is_ifs(*p)) {
+                *p++ = '\0';
+            }
+            if (*p) {
+                push_word(out, p);
+            }
+            p += strcspn(p, " \t\n");
+        }
+        return;
+    }
+
+    // General case: build the word piece by piece
+    struct word_builder wb = {0};
+    struct scan_state st = {0};
+    char* p = token;
+    if (token[0] == '~' && (token[1] == '/' || token[1] == '\0')) {
+        const char* home = get_var("HOME");
+        wb_add(&wb, home ? home : "~", 0, out, captures);
+        wb.started = 1;
+        p++;
+    }
+    for (; *p; p++) {
+        char quote = scan_quote(&st);
+        if (quote != '\'' && st.parens == 0 && p[0] == '$') {
+            char* end;
+            const char* text = expand_dollar(p, &end, captures);
+            if (text != NULL) {
+                wb_add(&wb, text, split && !quote, out, captures);
+                if (quote) {
+                    wb.started = 1;
+                }
+                p = end;
+                continue;
+            }
+        }
+        int was_parens = st.parens, was_top = st.top;
+        scan_char(&st, p > token ? p[-1] : 0, *p);
+        wb.started = 1;
+        // Quote characters themselves are dropped outside of (...)
+        if (was_parens > 0 || st.parens > 0 || st.top == was_top) {
+            wb_putc(&wb, *p);
+        }
+    }
+    wb_finish(&wb, out, captures);
+}
+
+// Expand parameters and substitutions in the body of a "<<DELIM\nbody"
+// word. A quoted delimiter keeps the body literal, as do quotes in it.
+static char* expand_heredoc(char* word, struct capture** captures) {
+    char* body = strchr(word, '\n');
+    char* quote = strpbrk(word, "'\"");
+    if (body == NULL || (quote != NULL && quote < body) || strchr(body, '$') == NULL) {
+        return word;
+    }
+    struct word_builder wb = {0};
+    for (char* p = word; *p; p++) {
+        char* end;
+        const char* text = p > body && *p == '$' ? expand_dollar(p, &end, captures) : NULL;
+        if (text != NULL) {
+            wb_add(&wb, text, 0, NULL, captures);
+            p = end;
+        } else {
+            wb_putc(&wb, *p);
+        }
+    }
+    struct word_list out = {0};
+    wb_finish(&wb, &out, captures);
+    char* result = out.words[0];
+    mem_free(MEM_EXPAND, out.words);
+    return result;
+}
+
+// Expand the tokens of one command into a new argument vector. The strings
+// belong to tokens or captures, so only the returned array itself is freed.
+char** expand_words(char** tokens, struct capture** captures) {
+    struct word_list out = {0};
+    push_word(&out, NULL);
+    out.count = 0;
+    for (int i = 0; tokens[i] != NULL; i++) {
+        int fd;
+        const char* op;
+        char* t = tokens[i];
+        if (strpbrk(t, "$'\"~") == NULL) {
+            push_word(&out, t);
+        } else if (parse_redirect(t, &fd, &op) > 0 && strcmp(op, "<<") == 0) {
+            push_word(&out, expand_heredoc(t, captures));
+        } else if (strcmp(t, "\"$@\"") == 0 || strcmp(t, "$@") == 0) {
+            for (int k = 0; k < positional_count; k++) {
+                push_word(&out, positional[k]);
+            }
+        } else {
+            expand_token(t, &out, captures, 1);
+        }
+    }
+    return out.words;
+}
+
+// Expand the NAME=value word of an assignment; the value is not split
+char* expand_assignment(char* word, struct capture** captures) {
+    if (strpbrk(word, "$'\"") == NULL) {
+        return word;
+    }
+    struct word_list out = {0};
+    expand_token(word, &out, captures, 0);
+    char* result = out.words[0];
+    mem_free(MEM_EXPAND, out.words);
+    return result;
+}
+
+// Release the buffers behind expanded words
+void free_captures(struct capture* captures) {
+    while (captures != NULL) {
+        struct capture* next = captures->next;
+        if (captures->map_len) {
+            munmap(captures->data, captures->map_len);
+        } else {
+            mem_free(MEM_EXPAND, captures->data);
+        }
+        mem_free(MEM_EXPAND, captures);
+        captures = next;
+    }
+}
+
+// Completion. Command names come from a compressed trie of the executables
+// in $PATH, built at the first completion and kept current with inotify, so
+// a Tab never rescans the PATH directories. Other words complete as file
+// names from a small cache of directory listings checked against mtime.
+
+// Node of the executable trie. Edges carry whole strings (a radix trie), so
+// a name costs a node only where it branches off from the others.
+struct trie_node {
+    char* label;               // Edge from the parent
+    uint64_t dirs;             // Bit i: the name ending here is in PATH directory i
+    struct trie_node** kids;   // Sorted by the first character of their labels
+    int kid_count;
+};
+
+// A watched PATH directory; its index is its bit in trie_node.dirs
+struct path_dir {
+    char* path;
+    int wd;
+};
+
+struct trie_node path_trie;
+char* trie_path;               // $PATH the trie was built from
+struct path_dir path_dirs[PATH_DIRS_MAX];
+int path_dir_count;
+int inotify_fd = -1;
+
+// Child of n whose label starts with c, or where it would go
+static int trie_find(struct trie_node* n, char c, int* found) {
+    int lo = 0, hi = n->kid_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((unsigned char)n->kids[mid]->label[0] < (unsigned char)c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = lo < n->kid_count && n->kids[lo]->label[0] == c;
+    return lo;
+}
+
+static struct trie_node* trie_new(const char* label, size_t len) {
+    struct trie_node* n = mem_calloc(MEM_OTHER, 1, sizeof(struct trie_node));
+    n->label = mem_strndup(MEM_OTHER, label, len);
+    return n;
+}
+
+static void trie_insert_kid(struct trie_node* n, int i, struct trie_node* kid) {
+    n->kids = mem_realloc(MEM_OTHER, n->kids, (n->kid_count + 1) * sizeof(struct trie_node*));
+    memmove(n->kids + i + 1, n->kids + i, (n->kid_count - i) * sizeof(struct trie_node*));
+    n->kids[i] = kid;
+    n->kid_count++;
+}
+
+// Mark name as present in PATH directory dir
+static void trie_add(const char* name, int dir) {
+    struct trie_node* n = &path_trie;
+    const char* p = name;
+    while (*p) {
+        int found, i = trie_find(n, *p, &found);
+        if (!found) {
+            trie_insert_kid(n, i, trie_new(p, strlen(p)));
+            n = n->kids[i];
+            break;
+        }
+        struct trie_node* kid = n->kids[i];
+        size_t common = 0;
+        while (kid->label[common] && kid->label[common] == p[common]) {
+            common++;
+        }
+        if (kid->label[common] != '\0') {
+            // The name leaves the edge part way: split it at that point
+            struct trie_node* mid = trie_new(kid->label, common);
+            memmove(kid->label, kid->label + common, strlen(kid->label + common) + 1);
+            trie_insert_kid(mid, 0, kid);
+            n->kids[i] = mid;
+            kid = mid;
+        }
+        n = kid;
+        p += common;
+    }
+    n->dirs |= 1ull << dir;
+}
+
+// Node where name ends exactly, or NULL
+static struct trie_node* trie_lookup(const char* name) {
+    struct trie_node* n = &path_trie;
+    while (*name) {
+        int found, i = trie_find(n, *name, &found);
+        size_t len = found ? strlen(n->kids[i]->label) : 0;
+        if (!found || strncmp(n->kids[i]->label, name, len) != 0) {
+            return NULL;
+        }
+        n = n->kids[i];
+        name += len;
+    }
+    return n;
+}
+
+static void trie_free(struct trie_node* n) {
+    for (int i = 0; i < n->kid_count; i++) {
+        trie_free(n->kids[i]);
+        mem_free(MEM_OTHER, n->kids[i]);
+    }
+    mem_free(MEM_OTHER, n->kids);
+    mem_free(MEM_OTHER, n->label);
+    memset(n, 0, sizeof(*n));
+}
+
+// A growing malloc'd list of malloc'd strings, handed to the line editor
+struct match_list {
+    char** items;
+    int count;
+    int cap;
+};
+
+static void add_match(struct match_list* m, const char* text, size_t len, const char* suffix) {
+    if (m->count + 2 > m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 16;
+        m->items = realloc(m->items, m->cap * sizeof(char*));
+    }
+    char* s = malloc(len + strlen(suffix) + 1);
+    memcpy(s, text, len);
+    strcpy(s + len, suffix);
+    m->items[m->count++] = s;
+    m->items[m->count] = NULL;
+}
+
+// Every name in the subtree of n; prefix holds the path down to n
+static void trie_collect(struct trie_node* n, char* prefix, size_t len, struct match_list* m) {
+    size_t label = strlen(n->label);
+    if (len + label >= MAX_LEN) {
+        return;
+    }
+    memcpy(prefix + len, n->label, label);
+    len += label;
+    if (n->dirs != 0) {
+        add_match(m, prefix, len, "");
+    }
+    for (int i = 0; i < n->kid_count; i++) {
+        trie_collect(n->kids[i], prefix, len, m);
+    }
+}
+
+// Executables in $PATH starting with word
+static void trie_complete(const char* word, struct match_list* m) {
+    char prefix[MAX_LEN];
+    struct trie_node* n = &path_trie;
+    const char* p = word;
+    size_t len = 0;
+    while (*p) {
+        int found, i = trie_find(n, *p, &found);
+        if (!found) {
+            return;
+        }
+        struct trie_node* kid = n->kids[i];
+        size_t label = strlen(kid->label), rest = strlen(p);
+        if (rest <= label) {
+            if (strncmp(kid->label, p, rest) == 0) {
+                memcpy(prefix, word, len);
+                trie_collect(kid, prefix, len, m);
+            }
+            return;
+        }
+        if (strncmp(kid->label, p, label) != 0) {
+            return;
+        }
+        len += label;
+        p += label;
+        n = kid;
+    }
+    for (int i = 0; i < n->kid_count; i++) {
+        memcpy(prefix, word, len);
+        trie_collect(n->kids[i], prefix, len, m);
+    }
+}
+
+// An executable file, not a directory
+static int is_executable(int dirfd, const char* name, unsigned char type) {
+    struct stat st;
+    if (type == DT_DIR || faccessat(dirfd, name, X_OK, 0) < 0) {
+        return 0;
+    }
+    return type == DT_REG || (fstatat(dirfd, name, &st, 0) == 0 && !S_ISDIR(st.st_mode));
+}
+
+// Add the executables of PATH directory i to the trie
+static void scan_path_dir(int i) {
+    DIR* d = opendir(path_dirs[i].path);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] != '.' && is_executable(dirfd(d), ent->d_name, ent->d_type)) {
+            trie_add(ent->d_name, i);
+        }
+    }
+    closedir(d);
+}
+
+// Build the trie and the watches from scratch for the current $PATH
+static void build_path_trie(const char* path) {
+    trie_free(&path_trie);
+    path_trie.label = mem_strdup(MEM_OTHER, "");
+    for (int i = 0; i < path_dir_count; i++) {
+        mem_free(MEM_OTHER, path_dirs[i].path);
+    }
+    path_dir_count = 0;
+    if (inotify_fd >= 0) {
+        close(inotify_fd);  // Drops all of its watches
+    }
+    inotify_fd = move_fd_high(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    mem_free(MEM_OTHER, trie_path);
+    trie_path = mem_strdup(MEM_OTHER, path);
+
+    char* copy = mem_strdup(MEM_OTHER, path);
+    char* save;
+    for (char* dir = strtok_r(copy, ":", &save); dir != NULL && path_dir_count < PATH_DIRS_MAX;
+         dir = strtok_r(NULL, ":", &save)) {
+        struct path_dir* pd = &path_dirs[path_dir_count];
+        pd->path = mem_strdup(MEM_OTHER, dir);
+        pd->wd = inotify_fd < 0 ? -1 : inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_DELETE | IN_ATTRIB |
+                                                        IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+        scan_path_dir(path_dir_count++);
+    }
+    mem_free(MEM_OTHER, copy);
+}
+
+// Bring the trie up to date before a completion: rebuild it if $PATH
+// changed, otherwise apply what inotify reported about single names
+static void update_path_trie(void) {
+    const char* path = get_var("PATH");
+    path = path ? path : "";
+    if (trie_path == NULL || strcmp(trie_path, path) != 0) {
+        build_path_trie(path);
+        return;
+    }
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    int rebuild = 0;
+    while (inotify_fd >= 0 && (len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            int i = 0;
+            while (i < path_dir_count && path_dirs[i].wd != ev->wd) {
+                i++;
+            }
+            if ((ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) || i == path_dir_count) {
+                rebuild = 1;  // Events were lost or a whole directory went away
+            } else if (ev->len > 0 && ev->name[0] != '.') {
+                int dirfd = open(path_dirs[i].path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (dirfd >= 0 && is_executable(dirfd, ev->name, DT_UNKNOWN)) {
+                    trie_add(ev->name, i);
+                } else {
+                    struct trie_node* n = trie_lookup(ev->name);
+                    if (n != NULL) {
+                        n->dirs &= ~(1ull << i);
+                    }
+                }
+                if (dirfd >= 0) {
+                    close(dirfd);
+                }
+            }
+        }
+    }
+    if (rebuild) {
+        build_path_trie(path);
+    }
+}
+
+// A directory listing for file name completion; directories end in '/'
+struct dir_listing {
+    char* path;
+    struct timespec mtime;   // The listing is redone when the directory changes
+    char** names;
+    int count;
+    unsigned long used;      // For evicting the least recently used
+};
+
+struct dir_listing dir_cache[DIR_CACHE_SIZE];
+unsigned long dir_cache_clock;
+
+static void free_listing(struct dir_listing* l) {
+    for (int i = 0; i < l->count; i++) {
+        mem_free(MEM_OTHER, l->names[i]);
+    }
+    mem_free(MEM_OTHER, l->names);
+    mem_free(MEM_OTHER, l->path);
+    memset(l, 0, sizeof(*l));
+}
+
+// Listing of dir from the cache, read again if its mtime moved
+static struct dir_listing* list_dir(const char* dir) {
+    struct stat st;
+    if (stat(dir, &st) < 0) {
+        return NULL;
+    }
+    struct dir_listing* l = &dir_cache[0];
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].path != NULL && strcmp(dir_cache[i].path, dir) == 0) {
+            l = &dir_cache[i];
+            break;
+        }
+        if (dir_cache[i].used < l->used) {
+            l = &dir_cache[i];
+        }
+    }
+    l->used = ++dir_cache_clock;
+    if (l->path != NULL && strcmp(l->path, dir) == 0 && l->mtime.tv_sec == st.st_mtim.tv_sec &&
+        l->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return l;
+    }
+
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return NULL;
+    }
+    free_listing(l);
+    l->path = mem_strdup(MEM_OTHER, dir);
+    l->mtime = st.st_mtim;
+    l->used = dir_cache_clock;
+    int cap = 0;
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        struct stat est;
+        int is_dir = ent->d_type == DT_DIR || ((ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) &&
+                                               fstatat(dirfd(d), ent->d_name, &est, 0) == 0 && S_ISDIR(est.st_mode));
+        if (l->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            l->names = mem_realloc(MEM_OTHER, l->names, cap * sizeof(char*));
+        }
+        char* name = mem_malloc(MEM_OTHER, strlen(ent->d_name) + 2);
+        sprintf(name, "%s%s", ent->d_name, is_dir ? "/" : "");
+        l->names[l->count++] = name;
+    }
+    closedir(d);
+    return l;
+}
+
+// Complete file names relative to the current directory
+static void complete_filename(const char* word, struct match_list* m) {
+    const char* slash = strrchr(word, '/');
+    const char* base = slash ? slash + 1 : word;
+    char dir[MAX_LEN];
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(base - word) : 1, slash ? word : ".");
+    struct dir_listing* l = list_dir(dir);
+    size_t blen = strlen(base);
+    for (int i = 0; l != NULL && i < l->count; i++) {
+        const char* name = l->names[i];
+        if (strncmp(name, base, blen) == 0 && (name[0] != '.' || base[0] == '.')) {
+            add_match(m, word, base - word, name);
+        }
+    }
+}
+
+// Whether the word at start is where a command name goes: first on the
+// line, after an operator, or after a keyword that starts a command
+static int command_position(const char* line, int start) {
+    static const char* keywords[] = {"if", "then", "else", "elif", "while", "until", "do", "!", "{", "pstat", NULL};
+    int end = start;
+    while (end > 0 && is_blank(line[end - 1])) {
+        end--;
+    }
+    if (end == 0 || strchr("|;&(", line[end - 1])) {
+        return 1;
+    }
+    int begin = end;
+    while (begin > 0 && !is_blank(line[begin - 1]) && !strchr("|;&(", line[begin - 1])) {
+        begin--;
+    }
+    for (int i = 0; keywords[i] != NULL; i++) {
+        if ((int)strlen(keywords[i]) == end - begin && strncmp(line + begin, keywords[i], end - begin) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compare_matches(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Candidates for the word line[start..end): commands (executables in
+// $PATH, builtins, functions, aliases) in command position, file names
+// elsewhere. Returns a malloc'd NULL-terminated list of malloc'd strings,
+// sorted and without duplicates, or NULL if there are none.
+char** complete_word(const char* line, int start, int end) {
+    char word[MAX_LEN];
+    int n = end - start < MAX_LEN - 1 ? end - start : MAX_LEN - 1;
+    memcpy(word, line + start, n);
+    word[n] = '\0';
+    struct match_list m = {0};
+    if (strchr(word, '/') != NULL || !command_position(line, start)) {
+        complete_filename(word, &m);
+    } else {
+        update_path_trie();
+        trie_complete(word, &m);
+        for (int i = 0; builtins[i].name != NULL; i++) {
+            if (strncmp(builtins[i].name, word, n) == 0) {
+                add_match(&m, builtins[i].name, strlen(builtins[i].name), "");
+            }
+        }
+        for (struct function* f = functions; f != NULL; f = f->next) {
+            if (strncmp(f->name, word, n) == 0) {
+                add_match(&m, f->name, strlen(f->name), "");
+            }
+        }
+        for (size_t i = 0; i < alias_cap; i++) {
+            const char* name = alias_table[i].name;
+            if (name != NULL && name != alias_removed && strncmp(name, word, n) == 0) {
+                add_match(&m, name, strlen(name), "");
+            }
+        }
+        if (m.count > 1) {
+            qsort(m.items, m.count, sizeof(char*), compare_matches);
+            int kept = 1;
+            for (int i = 1; i < m.count; i++) {
+                if (strcmp(m.items[i], m.items[kept - 1]) == 0) {
+                    free(m.items[i]);
+                } else {
+                    m.items[kept++] = m.items[i];
+                }
+            }
+            m.count = kept;
+            m.items[kept] = NULL;
+        }
+    }
+    return m.items;
+}
+
+#if !defined(BUILTIN_EDITOR) && !defined(PUCITSH_LIB)
+char** completion_matches;  // complete_word() result handed to readline one by one
+int completion_index;
+
+static char* next_completion(const char* text, int state) {
+    if (completion_matches == NULL || completion_matches[completion_index] == NULL) {
+        free(completion_matches);
+        completion_matches = NULL;
+        return NULL;
+    }
+    return completion_matches[completion_index++];
+}
+
+// readline's completion entry point, in place of its own file name completion
+static char** complete_for_readline(const char* text, int start, int end) {
+    rl_attempted_completion_over = 1;
+    completion_matches = complete_word(rl_line_buffer, start, end);
+    completion_index = 0;
+    if (completion_matches != NULL && completion_matches[0] != NULL && completion_matches[1] == NULL) {
+        const char* only = completion_matches[0];
+        rl_completion_suppress_append = only[strlen(only) - 1] == '/';
+    }
+    return rl_completion_matches(text, next_completion);
+}
+
+// Draw the line, then the history suggestion in grey when the cursor is at
+// its end, or clear the one left from before when it is not
+static void redisplay_with_suggestion(void) {
+    rl_redisplay();
+    const char* rest = rl_point == rl_end ? suggest(rl_line_buffer) : NULL;
+    if (rest != NULL) {
+        fprintf(rl_outstream, "\x1b[90m%s\x1b[0m\x1b[K\x1b[%dD", rest, (int)strlen(rest));
+    } else if (rl_point == rl_end) {
+        fprintf(rl_outstream, "\x1b[K");
+    } else {
+        fprintf(rl_outstream, "\x1b[%dC\x1b[K\x1b[%dD", rl_end - rl_point, rl_end - rl_point);
+    }
+    fflush(rl_outstream);
+}
+
+// Right arrow: take the suggestion at the end of the line, move on elsewhere
+static int forward_or_accept(int count, int key) {
+    const char* rest = rl_point == rl_end ? suggest(rl_line_buffer) : NULL;
+    if (rest == NULL) {
+        return rl_forward_char(count, key);
+    }
+    rl_insert_text(rest);
+    return 0;
+}
+
+// Return: run the line as typed, without its suggestion on the screen
+static int accept_line(int count, int key) {
+    if (rl_point == rl_end) {
+        fprintf(rl_outstream, "\x1b[K");
+    }
+    return rl_newline(count, key);
+}
+
+static void init_readline(void) {
+    using_history();  // Initialize history handling
+    stifle_history(HISTORY_SIZE);  // Keep the newest entries only, like the built-in editor
+    rl_attempted_completion_function = complete_for_readline;
+    rl_redisplay_function = redisplay_with_suggestion;
+    rl_bind_keyseq("\\e[C", forward_or_accept);
+    rl_bind_keyseq("\\eOC", forward_or_accept);
+    rl_bind_key(CTRL('f'), forward_or_accept);
+    rl_bind_key('\r', accept_line);
+    rl_bind_key('\n', accept_line);
+}
+#endif
+
+#ifndef BUILTIN_EDITOR
+// Read a command line with a prompt
+char* read_cmd(char* prompt) {
+    char* input = readline(prompt);
+    return input;
+}
+#endif
+
+
+// Read exactly len bytes; returns -1 on error or early end of input
+static int read_full(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Handle one daemon client in a forked worker: receive the request and the
+// client's descriptors, run the command line and send back its status
+static void serve_client(int conn) {
+    struct daemon_request req;
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n <= 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        fprintf(stderr, "daemon: malformed request\n");
+        exit(1);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if ((size_t)n < sizeof(req) && read_full(conn, (char*)&req + n, sizeof(req) - n) < 0) {
+        exit(1);
+    }
+    size_t total = (size_t)req.cmd_len + req.cwd_len + req.env_len;
+    if (req.magic != DAEMON_MAGIC || total > DAEMON_MAX_PAYLOAD) {
+        fprintf(stderr, "daemon: bad request header\n");
+        exit(1);
+    }
+    char* payload = malloc(total + 1);
+    if (read_full(conn, payload, total) < 0) {
+        exit(1);
+    }
+    payload[total] = '\0';
+    char* cmdline = strndup(payload, req.cmd_len);
+    char* cwd = strndup(payload + req.cmd_len, req.cwd_len);
+
+    // Take over the client's environment, directory and descriptors
+    clearenv();
+    char* env = payload + req.cmd_len + req.cwd_len;
+    for (char* e = env; e < env + req.env_len; e += strlen(e) + 1) {
+        if (strchr(e, '=') != NULL) {
+            putenv(e);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    struct daemon_reply reply = {DAEMON_MAGIC, 1};
+    serving = 1;
+    if (chdir(cwd) != 0) {
+        perror("daemon: cd failed");
+    } else {
+        reply.status = execute_cmdline(cmdline);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    send(conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+    exit(0);
+}
+
+// SIGCHLD handler for the daemon's accept loop, which only has workers
+static void reap_workers(int sig) {
+    int saved_errno = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+    errno = saved_errno;
+}
+
+// Listen on a UNIX-domain socket and run each client's command line in its
+// own forked worker, so many requests run at once and none of them pays for
+// a fresh shell startup
+int run_daemon(const char* path) {
+    char default_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    if (path == NULL) {
+        path = daemon_socket_path(default_path, sizeof(default_path));
+    }
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "daemon: socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("daemon: socket failed");
+        return 1;
+    }
+    unlink(path);
+    mode_t old_mask = umask(077);  // Only our own user may connect
+    int bound = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(sock, SOMAXCONN) < 0) {
+        perror("daemon: cannot listen");
+        close(sock);
+        return 1;
+    }
+
+    struct sigaction sa;
+    sa.sa_handler = &reap_workers;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+    fprintf(stderr, "PUCITshell daemon listening on %s\n", path);
+
+    for (;;) {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EINTR) {
+                perror("daemon: accept failed");
+            }
+            continue;
+        }
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid()) {
+            close(conn);
+            continue;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            sa.sa_handler = &handle_sigchld;
+            sigaction(SIGCHLD, &sa, NULL);
+            serve_client(conn);
+        } else if (pid < 0) {
+            perror("daemon: fork failed");
+        }
+        close(conn);
+    }
+}
+
+#ifdef PUCITSH_LIB
+// Embedding API of pucitsh.h. The interpreter's state is the process's, so
+// the context only marks it as taken.
+struct psh_ctx {
+    int open;
+};
+
+struct psh_script {
+    struct node** commands;  // One tree per command line
+    int count;
+};
+
+static struct psh_ctx psh_context;
+
+psh_ctx* psh_ctx_new(void) {
+    if (psh_context.open) {
+        errno = EBUSY;
+        return NULL;
+    }
+    psh_context.open = 1;
+    embedded = 1;
+    return &psh_context;
+}
+
+psh_script* psh_parse(psh_ctx* ctx, const char* text) {
+    struct input in = {0};
+    in.fd = -1;
+    in.text = text;
+    struct lexer lx = {0};
+    lx.in = &in;
+    psh_script* script = mem_calloc(MEM_PARSE, 1, sizeof(psh_script));
+    int eof = 0;
+    while (!eof) {
+        struct node* n = parse_command_line(&lx, &eof);
+        if (lx.error) {
+            psh_script_free(script);
+            script = NULL;
+            break;
+        }
+        if (n == NULL || n->kid_count == 0) {
+            free_node(n);
+            continue;
+        }
+        script->commands = mem_realloc(MEM_PARSE, script->commands, (script->count + 1) * sizeof(struct node*));
+        script->commands[script->count++] = n;
+    }
+    mem_free(MEM_PARSE, lx.line);
+    return script;
+}
+
+int psh_run(psh_ctx* ctx, psh_script* script) {
+    for (int i = 0; i < script->count; i++) {
+        update_jobs(0);
+        run_node(script->commands[i]);
+        int stop = interrupted;
+        // break, continue or return outside of a loop or function
+        break_levels = continue_levels = returning = interrupted = exiting = 0;
+        if (stop) {
+            break;
+        }
+    }
+    fflush(stdout);
+    return last_status;
+}
+
+void psh_script_free(psh_script* script) {
+    if (script == NULL) {
+        return;
+    }
+    for (int i = 0; i < script->count; i++) {
+        free_node(script->commands[i]);
+    }
+    mem_free(MEM_PARSE, script->commands);
+    mem_free(MEM_PARSE, script);
+}
+
+const char* psh_get_var(psh_ctx* ctx, const char* name) {
+    return get_var(name);
+}
+
+void psh_set_var(psh_ctx* ctx, const char* name, const char* value) {
+    set_var(name, value);
+}
+
+void psh_ctx_free(psh_ctx* ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    update_jobs(0);
+    forget_jobs();
+    for (int i = 0; i < VAR_BUCKETS; i++) {
+        while (var_table[i] != NULL) {
+            struct var* v = var_table[i];
+            var_table[i] = v->next;
+            mem_free(MEM_ENV, v->name);
+            mem_free(MEM_ENV, v->value);
+            mem_free(MEM_ENV, v);
+        }
+    }
+    while (functions != NULL) {
+        struct function* f = functions;
+        functions = f->next;
+        free_node(f->body);
+        mem_free(MEM_ENV, f->name);
+        mem_free(MEM_ENV, f);
+    }
+    for (size_t i = 0; i < alias_cap; i++) {
+        if (alias_table[i].name != NULL && alias_table[i].name != alias_removed) {
+            mem_free(MEM_ENV, alias_table[i].name);
+            mem_free(MEM_ENV, alias_table[i].value);
+        }
+    }
+    mem_free(MEM_ENV, alias_table);
+    alias_table = NULL;
+    alias_cap = alias_count = alias_used = 0;
+    struct history* h = &shell_history;
+    mem_free(MEM_HISTORY, h->arena);
+    mem_free(MEM_HISTORY, h->strings);
+    mem_free(MEM_HISTORY, h->set);
+    mem_free(MEM_HISTORY, h->entries);
+    *h = (struct history){.base = 1};
+    sug_prune(&suggest_root, INFINITY);
+    mem_free(MEM_HISTORY, suggest_root.kids);
+    suggest_root.kids = NULL;
+    suggest_lines = 0;
+    suggest_unit = 1;
+    last_status = 0;
+    ctx->open = 0;
+}
+#endif
+
+#ifdef BUILTIN_EDITOR
+// Built-in line editor used instead of GNU readline when compiled with
+// -DBUILTIN_EDITOR. It skips inputrc parsing and keymap setup, so the first
+// prompt appears as soon as the process starts.
+
+#define CTRL_KEY(c) ((c) & 0x1f)
+
+// Completion hook: returns a malloc'd, NULL-terminated list of malloc'd
+// candidates for the word line[start..end), or NULL if there are none.
+typedef char** (*completion_fn)(const char* line, int start, int end);
+completion_fn completion_hook = complete_word;
+
+struct line_state {
+    char* buf;          // Line being edited, always NUL-terminated
+    int len;            // Number of characters in buf
+    int cap;            // Allocated size of buf
+    int pos;            // Cursor position
+    const char* prompt;
+    int history_index;  // Entry shown while browsing history, hist_count() when editing
+    char* saved_line;   // Line being typed before history browsing started
+    int suggested;      // A history suggestion is shown after the line
+};
+
+static struct termios orig_termios;
+static char* kill_buffer = NULL;
+
+// Put the terminal into raw mode so keys arrive one at a time
+static int enable_raw_mode(void) {
+    struct termios raw;
+    if (tcgetattr(STDIN_FILENO, &orig_termios) == -1) {
+        return -1;
+    }
+    raw = orig_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+}
+
+static void disable_raw_mode(void) {
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+}
+
+// Read a line without editing when input is not a terminal
+static char* read_plain_line(void) {
+    int cap = MAX_LEN, pos = 0, c;
+    char* line = malloc(cap);
+    while ((c = getchar()) != EOF && c != '\n') {
+        if (pos + 1 >= cap) {
+            cap *= 2;
+            line = realloc(line, cap);
+        }
+        line[pos++] = c;
+    }
+    if (c == EOF && pos == 0) {
+        free(line);
+        return NULL;
+    }
+    line[pos] = '\0';
+    return line;
+}
+
+// Redraw the prompt and line, then move the cursor to its position
+static void refresh_line(struct line_state* ls) {
+    char seq[32];
+    int plen = strlen(ls->prompt);
+    write(STDOUT_FILENO, "\r", 1);
+    write(STDOUT_FILENO, ls->prompt, plen);
+    write(STDOUT_FILENO, ls->buf, ls->len);
+    const char* rest = ls->pos == ls->len ? suggest(ls->buf) : NULL;
+    ls->suggested = rest != NULL;
+    if (rest != NULL) {
+        write(STDOUT_FILENO, "\x1b[90m", 5);  // Grey
+        write(STDOUT_FILENO, rest, strlen(rest));
+        write(STDOUT_FILENO, "\x1b[0m", 4);
+    }
+    write(STDOUT_FILENO, "\x1b[K", 3);
+    int n = snprintf(seq, sizeof(seq), "\r\x1b[%dC", plen + ls->pos);
+    write(STDOUT_FILENO, seq, n);
+}
+
+// Make sure the buffer can hold extra more characters plus the terminator
+static void reserve(struct line_state* ls, int extra) {
+    if (ls->len + extra + 1 > ls->cap) {
+        while (ls->len + extra + 1 > ls->cap) {
+            ls->cap *= 2;
+        }
+        ls->buf = realloc(ls->buf, ls->cap);
+    }
+}
+
+static void insert_text(struct line_state* ls, const char* text, int n) {
+    reserve(ls, n);
+    memmove(ls->buf + ls->pos + n, ls->buf + ls->pos, ls->len - ls->pos + 1);
+    memcpy(ls->buf + ls->pos, text, n);
+    ls->pos += n;
+    ls->len += n;
+}
+
+// Delete buf[from..to) and optionally remember it for yanking
+static void delete_range(struct line_state* ls, int from, int to, int save) {
+    if (from >= to) {
+        return;
+    }
+    if (save) {
+        free(kill_buffer);
+        kill_buffer = strndup(ls->buf + from, to - from);
+    }
+    memmove(ls->buf + from, ls->buf + to, ls->len - to + 1);
+    ls->len -= to - from;
+    ls->pos = from;
+}
+
+static void set_line(struct line_state* ls, const char* text) {
+    ls->len = ls->pos = 0;
+    ls->buf[0] = '\0';
+    insert_text(ls, text, strlen(text));
+}
+
+// Right arrow or End at the end of the line takes the grey suggestion
+static void accept_suggestion(struct line_state* ls) {
+    const char* rest = ls->pos == ls->len ? suggest(ls->buf) : NULL;
+    if (rest != NULL) {
+        insert_text(ls, rest, strlen(rest));
+    }
+}
+
+// Step through history: dir is -1 for older, +1 for newer entries
+static void history_step(struct line_state* ls, int dir) {
+    int count = hist_count();
+    int next = ls->history_index + dir;
+    if (next < 0 || next > count) {
+        return;
+    }
+    if (ls->history_index == count) {
+        free(ls->saved_line);
+        ls->saved_line = strdup(ls->buf);
+    }
+    ls->history_index = next;
+    set_line(ls, next == count ? ls->saved_line : hist_line(next));
+}
+
+static int is_word_char(char c) {
+    return c != ' ' && c != '\t';
+}
+
+// Complete the word under the cursor through completion_hook
+static void complete_line(struct line_state* ls) {
+    int start = ls->pos;
+    while (start > 0 && is_word_char(ls->buf[start - 1])) {
+        start--;
+    }
+    char** matches = completion_hook ? completion_hook(ls->buf, start, ls->pos) : NULL;
+    if (matches == NULL || matches[0] == NULL) {
+        write(STDOUT_FILENO, "\a", 1);
+        free(matches);
+        return;
+    }
+
+    // Longest common prefix of all candidates
+    int common = strlen(matches[0]), count = 0;
+    for (int i = 0; matches[i] != NULL; i++, count++) {
+        int j = 0;
+        while (j < common && matches[i][j] == matches[0][j]) {
+            j++;
+        }
+        common = j;
+    }
+
+    int typed = ls->pos - start;
+    if (common > typed) {
+        insert_text(ls, matches[0] + typed, common - typed);
+        if (count == 1 && matches[0][common - 1] != '/') {
+            insert_text(ls, " ", 1);
+        }
+    } else if (count > 1) {
+        write(STDOUT_FILENO, "\r\n", 2);
+        for (int i = 0; matches[i] != NULL; i++) {
+            write(STDOUT_FILENO, matches[i], strlen(matches[i]));
+            write(STDOUT_FILENO, "  ", 2);
+        }
+        write(STDOUT_FILENO, "\r\n", 2);
+    }
+    for (int i = 0; matches[i] != NULL; i++) {
+        free(matches[i]);
+    }
+    free(matches);
+}
+
+// Handle an escape sequence; returns the equivalent control key or 0
+static int read_escape(void) {
+    char seq[3];
+    if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1) {
+        return 0;
+    }
+    if (seq[0] == '[') {
+        if (seq[1] >= '0' && seq[1] <= '9') {
+            if (read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~') {
+                return 0;
+            }
+            switch (seq[1]) {
+                case '1': case '7': return CTRL_KEY('a');
+                case '3': return 127 + 1;  // Delete key
+                case '4': case '8': return CTRL_KEY('e');
+            }
+            return 0;
+        }
+        switch (seq[1]) {
+            case 'A': return CTRL_KEY('p');
+            case 'B': return CTRL_KEY('n');
+            case 'C': return CTRL_KEY('f');
+            case 'D': return CTRL_KEY('b');
+            case 'H': return CTRL_KEY('a');
+            case 'F': return CTRL_KEY('e');
+        }
+    } else if (seq[0] == 'O') {
+        switch (seq[1]) {
+            case 'H': return CTRL_KEY('a');
+            case 'F': return CTRL_KEY('e');
+        }
+    }
+    return 0;
+}
+
+// Read a command line with a prompt using the built-in editor
+char* read_cmd(char* prompt) {
+    if (!isatty(STDIN_FILENO)) {
+        return read_plain_line();
+    }
+    fflush(stdout);
+    if (enable_raw_mode() == -1) {
+        return read_plain_line();
+    }
+
+    struct line_state ls = {0};
+    ls.cap = MAX_LEN;
+    ls.buf = malloc(ls.cap);
+    ls.buf[0] = '\0';
+    ls.prompt = prompt;
+    ls.history_index = hist_count();
+    refresh_line(&ls);
+
+    char c;
+    int done = 0;
+    while (!done && read(STDIN_FILENO, &c, 1) == 1) {
+        int key = (unsigned char)c;
+        if (key == 27) {
+            key = read_escape();
+        }
+        switch (key) {
+            case '\r':
+            case '\n':
+                if (ls.suggested) {
+                    write(STDOUT_FILENO, "\x1b[K", 3);  // The line runs as typed
+                }
+                done = 1;
+                break;
+            case CTRL_KEY('c'):
+                write(STDOUT_FILENO, "\x1b[K^C\r\n", 7);
+                ls.len = ls.pos = 0;
+                ls.buf[0] = '\0';
+                break;
+            case CTRL_KEY('d'):
+                if (ls.len == 0) {
+                    free(ls.buf);
+                    ls.buf = NULL;
+                    done = 1;
+                } else {
+                    delete_range(&ls, ls.pos, ls.pos < ls.len ? ls.pos + 1 : ls.pos, 0);
+                }
+                break;
+            case 127 + 1:
+                delete_range(&ls, ls.pos, ls.pos < ls.len ? ls.pos + 1 : ls.pos, 0);
+                break;
+            case 127:
+            case CTRL_KEY('h'):
+                if (ls.pos > 0) {
+                    delete_range(&ls, ls.pos - 1, ls.pos, 0);
+                }
+                break;
+            case CTRL_KEY('a'):
+                ls.pos = 0;
+                break;
+            case CTRL_KEY('e'):
+                accept_suggestion(&ls);
+                ls.pos = ls.len;
+                break;
+            case CTRL_KEY('b'):
+                if (ls.pos > 0) ls.pos--;
+                break;
+            case CTRL_KEY('f'):
+                if (ls.pos < ls.len) ls.pos++;
+                else accept_suggestion(&ls);
+                break;
+            case CTRL_KEY('k'):
+                delete_range(&ls, ls.pos, ls.len, 1);
+                break;
+            case CTRL_KEY('u'):
+                delete_range(&ls, 0, ls.pos, 1);
+                break;
+            case CTRL_KEY('w'): {
+                int start = ls.pos;
+                while (start > 0 && !is_word_char(ls.buf[start - 1])) start--;
+                while (start > 0 && is_word_char(ls.buf[start - 1])) start--;
+                delete_range(&ls, start, ls.pos, 1);
+                break;
+            }
+            case CTRL_KEY('y'):
+                if (kill_buffer) {
+                    insert_text(&ls, kill_buffer, strlen(kill_buffer));
+                }
+                break;
+            case CTRL_KEY('p'):
+                history_step(&ls, -1);
+                break;
+            case CTRL_KEY('n'):
+                history_step(&ls, 1);
+                break;
+            case CTRL_KEY('l'):
+                write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+                break;
+            case '\t':
+                complete_line(&ls);
+                break;
+            default:
+                if (key >= 32 && key < 127) {
+                    insert_text(&ls, &c, 1);
+                }
+                break;
+        }
+        if (!done) {
+            refresh_line(&ls);
+        }
+    }
+    disable_raw_mode();
+    write(STDOUT_FILENO, "\n", 1);
+    free(ls.saved_line);
+    if (!done && ls.len == 0) {
+        // Input closed before anything was typed
+        free(ls.buf);
+        return NULL;
+    }
+    return ls.buf;
+}
+#endif
@@ -0,0 +1,53 @@
+// libpucitsh: the myshellv5 interpreter as a library, built from myshellv5.c
+// with -DPUCITSH_LIB (see the README for the commands).
+//
+// A host program parses command lines once and runs them as often as it
+// likes. Pipelines, redirections, $(...), functions and builtins behave as
+// in myshellv5 -c, and external commands are forked straight from the host,
+// without the /bin/sh process system() starts for each call.
+//
+// The interpreter keeps its variables, functions and job table in the
+// process, so there is one context per process and calls on it must not
+// overlap. Commands use the host's descriptors 0, 1 and 2. Only processes
+// the library started are waited for, so the host keeps its own children;
+// it must not ignore SIGCHLD, which would reap ours too.
+
+#ifndef PUCITSH_H
+#define PUCITSH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PSH_API __attribute__((visibility("default")))
+
+typedef struct psh_ctx psh_ctx;
+typedef struct psh_script psh_script;
+
+// The interpreter of this process, or NULL with errno EBUSY while it is in use
+PSH_API psh_ctx* psh_ctx_new(void);
+
+// Parse one or more command lines. Returns NULL on a syntax error, which is
+// reported on stderr.
+PSH_API psh_script* psh_parse(psh_ctx* ctx, const char* text);
+
+// Run every command of a parsed script and return the exit status of the
+// last one. exit, or a command killed by Ctrl-C, ends the script early.
+PSH_API int psh_run(psh_ctx* ctx, psh_script* script);
+
+PSH_API void psh_script_free(psh_script* script);
+
+// Shell variables, seen by commands as $NAME. Variables of the environment
+// are found too, and setting one updates the environment.
+PSH_API const char* psh_get_var(psh_ctx* ctx, const char* name);
+PSH_API void psh_set_var(psh_ctx* ctx, const char* name, const char* value);
+
+// Drop the context's variables, functions, aliases, history and jobs.
+// Background jobs still running are left to the host.
+PSH_API void psh_ctx_free(psh_ctx* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif